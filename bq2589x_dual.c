@@ -24,150 +24,643 @@
 #include <linux/kthread.h>
 #include <linux/delay.h>
 #include <linux/of_gpio.h>
-#include "bq2589x_reg.h"
-
-enum bq2589x_vbus_type {
-	BQ2589X_VBUS_NONE,
-	BQ2589X_VBUS_USB_SDP,
-	BQ2589X_VBUS_USB_CDP,
-	BQ2589X_VBUS_USB_DCP,
-	BQ2589X_VBUS_MAXC,
-	BQ2589X_VBUS_UNKNOWN,
-	BQ2589X_VBUS_NONSTAND,
-	BQ2589X_VBUS_OTG,
-	BQ2589X_VBUS_TYPE_NUM,
+#include <linux/notifier.h>
+#include <linux/ktime.h>
+#include <linux/sort.h>
+#include <linux/math64.h>
+#include <linux/random.h>
+#include <linux/debugfs.h>
+#include <linux/vmalloc.h>
+#include <linux/regulator/driver.h>
+#include <linux/regulator/of_regulator.h>
+#include <linux/version.h>
+#include "bq2589x_dual.h"
+
+static const struct bq2589x_variant bq2589x_variants[] = {
+	{
+		.name = "bq25890",
+		.pn = BQ25890,
+		.features = BQ2589X_FEAT_DPDM | BQ2589X_FEAT_HVDCP | BQ2589X_FEAT_PUMPX | BQ2589X_FEAT_ICO,
+	},
+	{
+		.name = "bq25892",
+		.pn = BQ25892,
+		.features = BQ2589X_FEAT_PUMPX | BQ2589X_FEAT_ICO,	/* PSEL pin, no D+/D- */
+	},
+	{
+		.name = "bq25895",
+		.pn = BQ25895,
+		.features = BQ2589X_FEAT_DPDM | BQ2589X_FEAT_HVDCP | BQ2589X_FEAT_PUMPX | BQ2589X_FEAT_ICO,
+	},
+};
+
+static const char * const bq2589x_mark_name[BQ2589X_MARK_NUM] = {
+	"adapter_in", "pe_check", "pe_tuned", "ico_done", "chg2_enable",
+};
+
+static const char * const bq2589x_class_name[BQ2589X_BRINGUP_CLASS_NUM] = {
+	"none", "sdp", "cdp", "dcp", "maxc", "unknown", "nonstand", "otg", "pe",
+};
+
+static const char * const bq2589x_sm_state_name[BQ2589X_SM_NUM] = {
+	"idle", "adapter_in", "warm_start", "vindpm_settle", "pe_check", "pe_tune", "pe_pump_wait",
+	"pe_settled", "pe_failed", "ico", "ico_wait", "cache_apply", "cache_verify",
+	"chg2_enable", "charging",
+};
+
+static const char * const bq2589x_phase_name[BQ2589X_PHASE_NUM] = {
+	"5v_single", "boosted", "dual", "taper", "done",
+};
+
+static struct bq2589x *g_bq1;
+static struct bq2589x *g_bq2;
+static struct pe_ctrl pe;
+static struct bringup_ctrl bringup;
+static struct sm_ctrl sm;
+static struct acct_ctrl acct;
+static struct adapter_cache acache;
+static struct ir_ctrl ir = {
+	.max_clamp = 96,
+};
+static struct dpm_ctrl dpm = {
+	.step = 100,
+	.max_iinlim = 3250,
+	.vbus_shift = 500,
+	.vdpm_rerun = 3,
+};
+static struct ntc_ctrl ntc;
+static struct limits_ctrl ulim = {
+	.ichg = -1,
+	.iinlim = -1,
+	.vreg = -1,
+};
+static struct jeita_ctrl jeita = {
+	.hyst = 20,
+	.zone = -1,
+	.ichg_pm = 1000,
+};
+static struct step_ctrl step = {
+	.hyst = 100,
+};
+static struct chg2_ctrl chg2 = {
+	.exit_soc = 95,
+	.soc_hyst = 5,
+	.cv_margin = 50,
+	.vbat_hyst = 150,
+	.exit_current = 1000,
+	.taper_step = 256,
+	.taper_min = 512,
 };
 
-enum bq2589x_part_no {
-	BQ25890 = 0x03,
-	BQ25892 = 0x00,
-	BQ25895 = 0x07,
+static BLOCKING_NOTIFIER_HEAD(bq2589x_source_notifier);
+
+static DEFINE_MUTEX(bq2589x_bringup_lock);
+static DEFINE_SPINLOCK(bq2589x_sm_lock);
+static DEFINE_MUTEX(bq2589x_acct_lock);
+static DEFINE_MUTEX(bq2589x_cache_lock);
+static DEFINE_SPINLOCK(bq2589x_notify_lock);
+static DEFINE_SPINLOCK(bq2589x_adc_lock);
+static DEFINE_SPINLOCK(bq2589x_ulim_lock);
+/* charge side works against an OTG role swap, see bq2589x_otg_switch() */
+static DEFINE_MUTEX(bq2589x_role_lock);
+/*
+ * g_bq2 changes with both this and the role lock held. Charger 1's works
+ * use it under the role lock, sysfs and property readers under this one.
+ */
+static DEFINE_MUTEX(bq2589x_chg2_lock);
+
+#if IS_ENABLED(CONFIG_BQ2589X_DUAL_KUNIT_TEST)
+/* time the simulation skipped over instead of sleeping through it */
+static s64 bq2589x_test_skew_ms;
+
+const struct bq2589x_test_state bq2589x_test_state = {
+	.bq1		= &g_bq1,
+	.bq2		= &g_bq2,
+	.pe			= &pe,
+	.sm			= &sm,
+	.chg2		= &chg2,
+	.bringup	= &bringup,
+	.step		= &step,
+	.jeita		= &jeita,
+	.dpm		= &dpm,
+	.ir			= &ir,
+	.acct		= &acct,
+	.acache		= &acache,
+	.skew_ms	= &bq2589x_test_skew_ms,
 };
+#endif
+
+static DEFINE_MUTEX(bq2589x_i2c_lock);
+
+#define BQ2589X_I2C_RETRIES		3
+#define BQ2589X_I2C_BACKOFF_US	500
+
+/*
+ * Optional recorder of every register transaction, one ring per chip,
+ * sized by the trace_depth module parameter (0 leaves it off). The
+ * ring is dumped through debugfs as a fixed little-endian binary
+ * layout so captures from the field can be fed back offline.
+ */
+static unsigned int trace_depth;
+module_param(trace_depth, uint, 0444);
+MODULE_PARM_DESC(trace_depth, "i2c transactions kept per chip for debugfs dump, 0 to disable");
+
+/*
+ * sm_work records the task it runs on, that is the one context told
+ * apart; the values above stay reserved so dumps keep their meaning.
+ */
+static u8 bq2589x_trace_ctx(void)
+{
+	return sm.task == current ? BQ2589X_CTX_SM : BQ2589X_CTX_TASK;
+}
+
+static void bq2589x_trace_record(struct bq2589x *bq, u8 reg, const u8 *data,
+				u8 len, bool write, int ret)
+{
+	struct bq2589x_trace *t = bq->trace;
+	struct bq2589x_trace_rec *r;
 
+	if (!t)
+		return;
 
-#define BQ2589X_STATUS_PLUGIN		0x0001
-#define BQ2589X_STATUS_PG		0x0002
-#define BQ2589X_STATUS_FAULT		0x0008
+	spin_lock(&t->lock);
+	r = &t->rec[t->head++ & (t->depth - 1)];
+	r->ts_ns = cpu_to_le64(ktime_get_ns());
+	r->seq = cpu_to_le32(bq->xfer_count);
+	r->reg = reg;
+	r->len = len;
+	r->flags = (write ? BQ2589X_TRACE_WRITE : 0) | (ret ? BQ2589X_TRACE_ERROR : 0)
+			| (bq->primary ? 0 : BQ2589X_TRACE_CHG2);
+	r->ctx = bq2589x_trace_ctx();
+	r->state = sm.state;
+	r->ret = ret;
+	memset(r->data, 0, sizeof(r->data));
+	if (!ret)
+		memcpy(r->data, data, min_t(u8, len, BQ2589X_TRACE_DATA));
+	spin_unlock(&t->lock);
+}
 
-#define BQ2589X_STATUS_EXIST		0x0100
-#define BQ2589X_STATUS_CHARGE_ENABLE 0x0200
+static int bq2589x_trace_open(struct inode *inode, struct file *file)
+{
+	struct bq2589x *bq = inode->i_private;
+	struct bq2589x_trace *t = bq->trace;
+	struct bq2589x_trace_hdr *hdr;
+	struct bq2589x_trace_rec *out;
+	u32 count, first, i;
+
+	hdr = vmalloc(sizeof(*hdr) + t->depth * sizeof(*out));
+	if (!hdr)
+		return -ENOMEM;
+	out = (struct bq2589x_trace_rec *)(hdr + 1);
+
+	spin_lock(&t->lock);
+	count = min(t->head, t->depth);
+	first = t->head - count;
+	for (i = 0; i < count; i++)
+		out[i] = t->rec[(first + i) & (t->depth - 1)];
+	hdr->dropped = cpu_to_le32(first);
+	spin_unlock(&t->lock);
+
+	hdr->magic = cpu_to_le32(BQ2589X_TRACE_MAGIC);
+	hdr->version = BQ2589X_TRACE_VERSION;
+	hdr->rec_size = sizeof(*out);
+	hdr->part_no = bq->part_no;
+	hdr->primary = bq->primary;
+	hdr->count = cpu_to_le32(count);
+
+	file->private_data = hdr;
+	return 0;
+}
 
-struct bq2589x_config {
-	bool	enable_auto_dpdm;
-/*	bool	enable_12v;*/
+static ssize_t bq2589x_trace_read(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct bq2589x_trace_hdr *hdr = file->private_data;
 
-	int		charge_voltage;
-	int		charge_current;
+	return simple_read_from_buffer(buf, count, ppos, hdr,
+			sizeof(*hdr) + le32_to_cpu(hdr->count) * sizeof(struct bq2589x_trace_rec));
+}
 
-	bool	enable_term;
-	int		term_current;
+static int bq2589x_trace_release(struct inode *inode, struct file *file)
+{
+	vfree(file->private_data);
+	return 0;
+}
 
-	bool 	enable_ico;
-	bool	enable_absolute_vindpm;
+static const struct file_operations bq2589x_trace_fops = {
+	.owner		= THIS_MODULE,
+	.open		= bq2589x_trace_open,
+	.read		= bq2589x_trace_read,
+	.release	= bq2589x_trace_release,
+	.llseek		= default_llseek,
 };
 
+static void bq2589x_trace_init(struct bq2589x *bq)
+{
+	struct bq2589x_trace *t;
+	u32 depth;
+
+	BUILD_BUG_ON(sizeof(struct bq2589x_trace_rec) != 32);
+
+	if (!trace_depth)
+		return;
+
+	if (trace_depth > BQ2589X_TRACE_MAX_DEPTH) {
+		dev_warn(bq->dev, "%s: trace_depth %u limited to %u\n", __func__,
+			trace_depth, BQ2589X_TRACE_MAX_DEPTH);
+		trace_depth = BQ2589X_TRACE_MAX_DEPTH;
+	}
+	depth = roundup_pow_of_two(trace_depth);
+	t = devm_kzalloc(bq->dev, sizeof(*t) + depth * sizeof(t->rec[0]), GFP_KERNEL);
+	if (!t) {
+		dev_err(bq->dev, "%s: no memory for %u trace records\n", __func__, depth);
+		return;
+	}
+	spin_lock_init(&t->lock);
+	t->depth = depth;
+	bq->trace = t;
+}
 
-struct bq2589x {
-	struct device *dev;
-	struct i2c_client *client;
+static void bq2589x_trace_debugfs(struct bq2589x *bq)
+{
+	if (!bq->trace)
+		return;
+
+	bq->debug_dir = debugfs_create_dir(dev_name(bq->dev), NULL);
+	if (IS_ERR_OR_NULL(bq->debug_dir)) {
+		bq->debug_dir = NULL;
+		return;
+	}
+	debugfs_create_file("i2c_trace", 0400, bq->debug_dir, bq, &bq2589x_trace_fops);
+}
 
-	enum   bq2589x_part_no part_no;
-	int    revision;
+/* one SMBus transaction: the byte for a single read, < 0 on error */
+static int bq2589x_smbus_xfer(struct bq2589x *bq, u8 reg, u8 *data, u8 len, bool write)
+{
+#if IS_ENABLED(CONFIG_BQ2589X_DUAL_KUNIT_TEST)
+	if (bq->test_xfer)
+		return bq->test_xfer(bq, reg, data, len, write);
+#endif
 
-	unsigned int    status;
-	int		vbus_type;
+	if (len > 1 && write)
+		return i2c_smbus_write_i2c_block_data(bq->client, reg, len, data);
+	else if (len > 1)
+		return i2c_smbus_read_i2c_block_data(bq->client, reg, len, data);
+	else if (write)
+		return i2c_smbus_write_byte_data(bq->client, reg, *data);
+	else
+		return i2c_smbus_read_byte_data(bq->client, reg);
+}
 
-	bool	enabled;
+/*
+ * A NAK on a noisy bus is retried a bounded number of times with an
+ * exponential, jittered backoff so both chips don't retry in lockstep.
+ * The bus lock is dropped while backing off. If enabled in DT, the bus
+ * is recovered once before giving up.
+ */
+static int bq2589x_i2c_xfer(struct bq2589x *bq, u8 reg, u8 *data, u8 len, bool write)
+{
+	bool recovered = false;
+	unsigned int backoff;
+	int attempt = 0;
+	int ret;
 
-	bool    interrupt;
+	/* sm_work's own transfers, once per transfer however often it is retried */
+	if (sm.task == current)
+		sm.run_xfers++;
 
+	for (;;) {
+		mutex_lock(&bq2589x_i2c_lock);
+		bq->xfer_count++;
+		ret = bq2589x_smbus_xfer(bq, reg, data, len, write);
 
-	int     vbus_volt;
-	int     vbat_volt;
+		if (len > 1 && ret >= 0 && !write && ret != len)
+			ret = -EIO;	/* short block read */
 
-	int     rsoc;
-	struct	bq2589x_config	cfg;
-	struct work_struct irq_work;
-	struct work_struct adapter_in_work;
-	struct work_struct adapter_out_work;
-	struct delayed_work monitor_work;
-	struct delayed_work ico_work;
-	struct delayed_work pe_volt_tune_work;
-	struct delayed_work check_pe_tuneup_work;
-	struct delayed_work charger2_enable_work;
+		if (ret >= 0) {
+			if (attempt)
+				bq->i2c_retried++;
+			mutex_unlock(&bq2589x_i2c_lock);
+			break;
+		}
 
+		bq->i2c_errors++;
+		if (attempt == BQ2589X_I2C_RETRIES) {
+			if (!bq->cfg.i2c_bus_recovery || recovered) {
+				bq->i2c_failures++;
+				bq2589x_trace_record(bq, reg, data, len, write, ret);
+				mutex_unlock(&bq2589x_i2c_lock);
+				dev_err(bq->dev, "failed to %s 0x%.2x:%d\n", write ? "write" : "read", reg, ret);
+				return ret;
+			}
+			bq->i2c_recoveries++;
+			i2c_recover_bus(bq->client->adapter);
+			recovered = true;
+			attempt = 0;
+		}
+		mutex_unlock(&bq2589x_i2c_lock);
 
+		backoff = BQ2589X_I2C_BACKOFF_US << attempt;
+		usleep_range(backoff, backoff + prandom_u32() % backoff);
+		attempt++;
+	}
 
-	struct power_supply usb;
-	struct power_supply wall;
-	struct power_supply *batt_psy;
+	if (len == 1 && !write)
+		*data = (u8)ret;
+	bq2589x_trace_record(bq, reg, data, len, write, 0);
 
+	return 0;
+}
 
+/*
+ * Shadow of the configuration registers as the driver intends them.
+ * Every successful write updates it; while staging, writes land in the
+ * shadow only and bq2589x_stage_end() pushes the difference.
+ */
+#define BQ2589X_SHADOW_IN(reg)	((reg) < BQ2589X_SHADOW_NUM && (reg) != BQ2589X_REG_0B && (reg) != BQ2589X_REG_0C)
+
+/* self clearing or one-shot bits, never compared nor restored */
+static const u8 bq2589x_shadow_volatile[BQ2589X_SHADOW_NUM] = {
+	[BQ2589X_REG_02] = BQ2589X_CONV_START_MASK | BQ2589X_FORCE_DPDM_MASK,
+	[BQ2589X_REG_03] = BQ2589X_WDT_RESET_MASK,
+	[BQ2589X_REG_09] = BQ2589X_FORCE_ICO_MASK | BQ2589X_BATFET_DIS_MASK
+				| BQ2589X_PUMPX_UP_MASK | BQ2589X_PUMPX_DOWN_MASK,
 };
 
-struct pe_ctrl {
-	bool enable;
-	bool tune_up_volt;
-	bool tune_down_volt;
-	bool tune_done;
-	bool tune_fail;
-	int  tune_count;
-	int  target_volt;
-	int	 high_volt_level;/* vbus volt > this threshold means tune up successfully */
-	int  low_volt_level; /* vbus volt < this threshold means tune down successfully */
-	int  vbat_min_volt;  /* to tune up voltage only when vbat > this threshold */
-};
+/*
+ * Register access is serialized per chip by reg_lock. A staging sequence
+ * holds it from bq2589x_stage_begin() to bq2589x_stage_end(): only the
+ * stager's own accesses are redirected to the shadow, every other context
+ * waits, so nothing is dropped or written out of order around the apply.
+ */
+static bool bq2589x_staging(struct bq2589x *bq)
+{
+	return bq->stager == current;
+}
 
-static struct bq2589x *g_bq1;
-static struct bq2589x *g_bq2;
-static struct pe_ctrl pe;
+static void bq2589x_reg_lock(struct bq2589x *bq)
+{
+	if (!bq2589x_staging(bq))
+		mutex_lock(&bq->reg_lock);
+}
 
+static void bq2589x_reg_unlock(struct bq2589x *bq)
+{
+	if (!bq2589x_staging(bq))
+		mutex_unlock(&bq->reg_lock);
+}
 
-static DEFINE_MUTEX(bq2589x_i2c_lock);
+static int bq2589x_read_byte_unlocked(struct bq2589x *bq, u8 *data, u8 reg)
+{
+	if (bq2589x_staging(bq) && BQ2589X_SHADOW_IN(reg)) {
+		*data = bq->shadow[reg];
+		return 0;
+	}
+
+	return bq2589x_i2c_xfer(bq, reg, data, 1, false);
+}
+
+static int bq2589x_write_byte_unlocked(struct bq2589x *bq, u8 reg, u8 data)
+{
+	int ret = 0;
+
+	if (!bq2589x_staging(bq) || !BQ2589X_SHADOW_IN(reg))
+		ret = bq2589x_i2c_xfer(bq, reg, &data, 1, true);
+	if (!ret && BQ2589X_SHADOW_IN(reg))
+		bq->shadow[reg] = data;
+
+	return ret;
+}
 
 static int bq2589x_read_byte(struct bq2589x *bq, u8 *data, u8 reg)
 {
 	int ret;
 
-	mutex_lock(&bq2589x_i2c_lock);
-	ret = i2c_smbus_read_byte_data(bq->client, reg);
-	if (ret < 0) {
-		dev_err(bq->dev, "failed to read 0x%.2x\n", reg);
-		mutex_unlock(&bq2589x_i2c_lock);
+	bq2589x_reg_lock(bq);
+	ret = bq2589x_read_byte_unlocked(bq, data, reg);
+	bq2589x_reg_unlock(bq);
+
+	return ret;
+}
+
+static int bq2589x_write_byte(struct bq2589x *bq, u8 reg, u8 data)
+{
+	int ret;
+
+	bq2589x_reg_lock(bq);
+	ret = bq2589x_write_byte_unlocked(bq, reg, data);
+	bq2589x_reg_unlock(bq);
+
+	return ret;
+}
+
+/* status and ADC blocks, never in the shadow, still ordered against a stager */
+static int bq2589x_read_block(struct bq2589x *bq, u8 reg, u8 *data, u8 len)
+{
+	int ret;
+
+	bq2589x_reg_lock(bq);
+	ret = bq2589x_i2c_xfer(bq, reg, data, len, false);
+	bq2589x_reg_unlock(bq);
+
+	return ret;
+}
+
+/* REG0B/0C are status and fault (read clears), so 00-0A and 0D separately */
+static int bq2589x_shadow_read_hw(struct bq2589x *bq, u8 *regs)
+{
+	int ret;
+
+	ret = bq2589x_i2c_xfer(bq, BQ2589X_REG_00, regs, BQ2589X_REG_0A + 1, false);
+	if (ret)
+		return ret;
+
+	return bq2589x_i2c_xfer(bq, BQ2589X_REG_0D, &regs[BQ2589X_REG_0D], 1, false);
+}
+
+BQ2589X_VISIBLE int bq2589x_shadow_load(struct bq2589x *bq)
+{
+	return bq2589x_shadow_read_hw(bq, bq->shadow);
+}
+
+/* write back only what differs from the shadow, contiguous runs in one transfer */
+static int bq2589x_shadow_apply_unlocked(struct bq2589x *bq)
+{
+	u8 want[BQ2589X_SHADOW_NUM];
+	u8 hw[BQ2589X_SHADOW_NUM];
+	u8 keep;
+	int start = -1;
+	int count = 0;
+	int reg;
+	int ret;
+
+	ret = bq2589x_shadow_read_hw(bq, hw);
+	if (ret)
 		return ret;
+
+	for (reg = 0; reg <= BQ2589X_SHADOW_NUM; reg++) {
+		if (reg < BQ2589X_SHADOW_NUM && BQ2589X_SHADOW_IN(reg)) {
+			keep = bq2589x_shadow_volatile[reg];
+			/* relative VINDPM is tracked by the chip itself */
+			if (reg == BQ2589X_REG_0D && !(bq->shadow[reg] & BQ2589X_FORCE_VINDPM_MASK))
+				keep = 0xFF;
+			want[reg] = (bq->shadow[reg] & ~keep) | (hw[reg] & keep);
+			if (want[reg] != hw[reg]) {
+				if (start < 0)
+					start = reg;
+				continue;
+			}
+		}
+
+		if (start < 0)
+			continue;
+
+		ret = bq2589x_i2c_xfer(bq, start, &want[start], reg - start, true);
+		if (ret)
+			return ret;
+		count += reg - start;
+		start = -1;
 	}
 
-	*data = (u8)ret;
-	mutex_unlock(&bq2589x_i2c_lock);
+	if (count)
+		dev_info(bq->dev, "%s:restored %d register(s)\n", __func__, count);
 
 	return 0;
 }
 
-static int bq2589x_write_byte(struct bq2589x *bq, u8 reg, u8 data)
+BQ2589X_VISIBLE int bq2589x_shadow_apply(struct bq2589x *bq)
 {
 	int ret;
-	mutex_lock(&bq2589x_i2c_lock);
-	ret = i2c_smbus_write_byte_data(bq->client, reg, data);
-	mutex_unlock(&bq2589x_i2c_lock);
+
+	bq2589x_reg_lock(bq);
+	ret = bq2589x_shadow_apply_unlocked(bq);
+	bq2589x_reg_unlock(bq);
+
+	return ret;
+}
+
+BQ2589X_VISIBLE void bq2589x_stage_begin(struct bq2589x *bq)
+{
+	mutex_lock(&bq->reg_lock);
+	bq->stager = current;
+}
+
+/* push the staged configuration unless the caller gave up on it */
+BQ2589X_VISIBLE int bq2589x_stage_end(struct bq2589x *bq, bool apply)
+{
+	int ret = 0;
+
+	if (apply)
+		ret = bq2589x_shadow_apply_unlocked(bq);
+	bq->stager = NULL;
+	mutex_unlock(&bq->reg_lock);
+
 	return ret;
 }
 
+/*
+ * A watchdog expiry or chip reset silently reverts everything to power on
+ * defaults. The WDT field of REG07 never holds its 40s default once
+ * initialized (160s on charger 1 during a session, disabled otherwise),
+ * so it doubles as a sentinel for resets that leave no fault behind.
+ */
+static void bq2589x_shadow_check(struct bq2589x *bq, bool wdt_fault)
+{
+	u8 val;
+
+	if (!bq || !bq->shadow_loaded)
+		return;
+
+	if (!wdt_fault) {
+		if (bq2589x_read_byte(bq, &val, BQ2589X_REG_07))
+			return;
+		if (!((val ^ bq->shadow[BQ2589X_REG_07]) & BQ2589X_WDT_MASK))
+			return;
+	}
+
+	dev_warn(bq->dev, "%s:register reset detected%s, restoring configuration\n",
+		__func__, wdt_fault ? " (watchdog)" : "");
+	bq2589x_shadow_apply(bq);
+}
+
 static int bq2589x_update_bits(struct bq2589x *bq, u8 reg, u8 mask, u8 data)
 {
 	int ret;
 	u8 tmp;
 
-	ret = bq2589x_read_byte(bq, &tmp, reg);
+	bq2589x_reg_lock(bq);
+	ret = bq2589x_read_byte_unlocked(bq, &tmp, reg);
+	if (!ret) {
+		tmp &= ~mask;
+		tmp |= data & mask;
+		ret = bq2589x_write_byte_unlocked(bq, reg, tmp);
+	}
+	bq2589x_reg_unlock(bq);
 
-	if (ret)
-		return ret;
+	return ret;
+}
+
+
+static u32 bq2589x_total_xfers(void)
+{
+	u32 count;
+
+	mutex_lock(&bq2589x_i2c_lock);
+	count = g_bq1->xfer_count + (g_bq2 ? g_bq2->xfer_count : 0);
+	mutex_unlock(&bq2589x_i2c_lock);
+
+	return count;
+}
+
+/*
+ * Change notification for userspace: uevents on the supplies and
+ * sysfs_notify() on pollable attributes. A burst of changes is coalesced
+ * into one notification and notifications are spaced at least
+ * BQ2589X_NOTIFY_INTERVAL_MS apart.
+ */
+#define BQ2589X_CHANGED_PSY		BIT(0)	/* supply properties, uevent */
+#define BQ2589X_CHANGED_SM		BIT(1)	/* sm_stats */
+
+#define BQ2589X_NOTIFY_INTERVAL_MS	250
+
+static void bq2589x_changed(unsigned long what)
+{
+	struct bq2589x *bq = g_bq1;
+	unsigned long next;
+	unsigned long flags;
+
+	if (!bq)
+		return;
 
-	tmp &= ~mask;
-	tmp |= data & mask;
+	spin_lock_irqsave(&bq2589x_notify_lock, flags);
+	bq->notify_pending |= what;
+	spin_unlock_irqrestore(&bq2589x_notify_lock, flags);
 
-	return bq2589x_write_byte(bq, reg, tmp);
+	next = bq->notify_last + msecs_to_jiffies(BQ2589X_NOTIFY_INTERVAL_MS);
+	schedule_delayed_work(&bq->notify_work, time_after(next, jiffies) ? next - jiffies : 0);
 }
 
+static void bq2589x_notify_workfunc(struct work_struct *work)
+{
+	struct bq2589x *bq = container_of(work, struct bq2589x, notify_work.work);
+	unsigned long what;
+	unsigned long flags;
+
+	spin_lock_irqsave(&bq2589x_notify_lock, flags);
+	what = bq->notify_pending;
+	bq->notify_pending = 0;
+	spin_unlock_irqrestore(&bq2589x_notify_lock, flags);
+
+	bq->notify_last = jiffies;
+
+	if (what & BQ2589X_CHANGED_PSY) {
+		power_supply_changed(&bq->usb);
+		power_supply_changed(&bq->wall);
+	}
+
+	if (what & BQ2589X_CHANGED_SM)
+		sysfs_notify(&bq->dev->kobj, NULL, "sm_stats");
+}
 
 static enum bq2589x_vbus_type bq2589x_get_vbus_type(struct bq2589x *bq)
 {
@@ -202,15 +695,9 @@ EXPORT_SYMBOL_GPL(bq2589x_disable_otg);
 
 static int bq2589x_set_otg_volt(struct bq2589x *bq, int volt)
 {
-	u8 val = 0;
-
-	if (volt < BQ2589X_BOOSTV_BASE)
-		volt = BQ2589X_BOOSTV_BASE;
-	if (volt > BQ2589X_BOOSTV_BASE + (BQ2589X_BOOSTV_MASK >> BQ2589X_BOOSTV_SHIFT) * BQ2589X_BOOSTV_LSB)
-		volt = BQ2589X_BOOSTV_BASE + (BQ2589X_BOOSTV_MASK >> BQ2589X_BOOSTV_SHIFT) * BQ2589X_BOOSTV_LSB;
-
+	u8 val;
 
-	val = ((volt - BQ2589X_BOOSTV_BASE) / BQ2589X_BOOSTV_LSB) << BQ2589X_BOOSTV_SHIFT;
+	val = BQ2589X_ENCODE(volt, BOOSTV);
 
 	return bq2589x_update_bits(bq, BQ2589X_REG_0A, BQ2589X_BOOSTV_MASK, val);
 
@@ -266,6 +753,21 @@ static int bq2589x_disable_charger(struct bq2589x *bq)
 
 
 /* interfaces that can be called by other module */
+/*
+ * Entry point for an external Type-C/PD driver to publish the advertised
+ * source capability. volt == 0 withdraws the contract.
+ */
+int bq2589x_notify_source_cap(int volt, int curr)
+{
+	struct bq2589x_source_cap cap = {
+		.volt = volt,
+		.curr = curr,
+	};
+
+	return blocking_notifier_call_chain(&bq2589x_source_notifier, 0, &cap);
+}
+EXPORT_SYMBOL_GPL(bq2589x_notify_source_cap);
+
 int bq2589x_adc_start(struct bq2589x *bq, bool oneshot)
 {
 	u8 val;
@@ -305,7 +807,7 @@ int bq2589x_adc_read_battery_volt(struct bq2589x *bq)
 		dev_err(bq->dev, "read battery voltage failed :%d\n", ret);
 		return ret;
 	} else {
-		volt = BQ2589X_BATV_BASE + ((val & BQ2589X_BATV_MASK) >> BQ2589X_BATV_SHIFT) * BQ2589X_BATV_LSB ;
+		volt = BQ2589X_DECODE(val, BATV);
 		return volt;
 	}
 }
@@ -323,7 +825,7 @@ int bq2589x_adc_read_sys_volt(struct bq2589x *bq)
 		dev_err(bq->dev, "read system voltage failed :%d\n", ret);
 		return ret;
 	} else {
-		volt = BQ2589X_SYSV_BASE + ((val & BQ2589X_SYSV_MASK) >> BQ2589X_SYSV_SHIFT) * BQ2589X_SYSV_LSB ;
+		volt = BQ2589X_DECODE(val, SYSV);
 		return volt;
 	}
 }
@@ -340,16 +842,33 @@ int bq2589x_adc_read_vbus_volt(struct bq2589x *bq)
 		dev_err(bq->dev, "read vbus voltage failed :%d\n", ret);
 		return ret;
 	} else {
-		volt = BQ2589X_VBUSV_BASE + ((val & BQ2589X_VBUSV_MASK) >> BQ2589X_VBUSV_SHIFT) * BQ2589X_VBUSV_LSB ;
+		volt = BQ2589X_DECODE(val, VBUSV);
 		return volt;
 	}
 }
 EXPORT_SYMBOL_GPL(bq2589x_adc_read_vbus_volt);
 
+/* TS milli-percent to 0.1C through the DT NTC table */
+static int bq2589x_ntc_temp(int mpct)
+{
+	int i;
+
+	if (mpct >= ntc.mpct[0])
+		return ntc.temp[0];
+
+	for (i = 1; i < ntc.num; i++) {
+		if (mpct >= ntc.mpct[i])
+			return ntc.temp[i] - (ntc.temp[i] - ntc.temp[i - 1]) * (mpct - ntc.mpct[i])
+					/ (ntc.mpct[i - 1] - ntc.mpct[i]);
+	}
+
+	return ntc.temp[ntc.num - 1];
+}
+
+/* raw TS reading, scaled as it always was, see bq2589x_adc_read_batt_temp() */
 int bq2589x_adc_read_temperature(struct bq2589x *bq)
 {
 	uint8_t val;
-	int temp;
 	int ret;
 
 	ret = bq2589x_read_byte(bq, &val, BQ2589X_REG_10);
@@ -357,12 +876,31 @@ int bq2589x_adc_read_temperature(struct bq2589x *bq)
 		dev_err(bq->dev, "read temperature failed :%d\n", ret);
 		return ret;
 	} else {
-		temp = BQ2589X_TSPCT_BASE + ((val & BQ2589X_TSPCT_MASK) >> BQ2589X_TSPCT_SHIFT) * BQ2589X_TSPCT_LSB ;
-		return temp;
+		return BQ2589X_TSPCT_BASE / 1000 + ((val & BQ2589X_TSPCT_MASK) >> BQ2589X_TSPCT_SHIFT) * BQ2589X_TSPCT_LSB;
 	}
 }
 EXPORT_SYMBOL_GPL(bq2589x_adc_read_temperature);
 
+/* battery temperature in 0.1C through the NTC table, -ENODATA without one */
+int bq2589x_adc_read_batt_temp(struct bq2589x *bq, int *temp)
+{
+	uint8_t val;
+	int ret;
+
+	if (!ntc.num)
+		return -ENODATA;
+
+	ret = bq2589x_read_byte(bq, &val, BQ2589X_REG_10);
+	if (ret < 0) {
+		dev_err(bq->dev, "read temperature failed :%d\n", ret);
+		return ret;
+	}
+
+	*temp = bq2589x_ntc_temp(BQ2589X_DECODE(val, TSPCT));
+	return 0;
+}
+EXPORT_SYMBOL_GPL(bq2589x_adc_read_batt_temp);
+
 int bq2589x_adc_read_charge_current(struct bq2589x *bq)
 {
 	uint8_t val;
@@ -374,41 +912,222 @@ int bq2589x_adc_read_charge_current(struct bq2589x *bq)
 		dev_err(bq->dev, "read charge current failed :%d\n", ret);
 		return ret;
 	} else {
-		volt = (int)(BQ2589X_ICHGR_BASE + ((val & BQ2589X_ICHGR_MASK) >> BQ2589X_ICHGR_SHIFT) * BQ2589X_ICHGR_LSB) ;
+		volt = BQ2589X_DECODE(val, ICHGR);
 		return volt;
 	}
 }
 EXPORT_SYMBOL_GPL(bq2589x_adc_read_charge_current);
 
-int bq2589x_set_chargecurrent(struct bq2589x *bq, int curr)
+static int bq2589x_cmp_int(const void *a, const void *b)
 {
+	return *(const int *)a - *(const int *)b;
+}
 
-	u8 ichg;
+/*
+ * A single conversion carries the 100mV VBUS LSB plus adapter ripple,
+ * enough to call a pump step done early or to place VINDPM off by a
+ * step. All channels are sampled with one block read into a short
+ * window per channel. Step decisions take the median of the window,
+ * telemetry an EWMA. A sample far from the window median is held back
+ * once; a second one in a row is a real step and restarts the window.
+ */
+static const int bq2589x_adc_outlier[BQ2589X_CH_NUM] = {
+	[BQ2589X_CH_BATV]	= 200,
+	[BQ2589X_CH_SYSV]	= 300,
+	[BQ2589X_CH_TSPCT]	= 3000,
+	[BQ2589X_CH_VBUSV]	= 1500,
+	[BQ2589X_CH_ICHGR]	= 1000,
+};
 
-	ichg = (curr - BQ2589X_ICHG_BASE) / BQ2589X_ICHG_LSB;
-	return bq2589x_update_bits(bq, BQ2589X_REG_04, BQ2589X_ICHG_MASK, ichg << BQ2589X_ICHG_SHIFT);
+static void bq2589x_adc_filter_init(struct bq2589x *bq)
+{
+	bq->cfg.adc_window = 3;
+	bq->cfg.adc_sample_ms = 1000;
+	bq->cfg.adc_ewma_shift = 2;
+	bq->adc_period_ms = bq->cfg.adc_sample_ms;
+}
 
+/*
+ * A sample counts towards the median while it is younger than two window
+ * lengths at the rate sampling currently runs: the conversion period for
+ * state machine decisions, the monitor period while charging.
+ */
+static unsigned int bq2589x_adc_max_age(struct bq2589x *bq)
+{
+	return bq->cfg.adc_window * bq->adc_period_ms * 2;
 }
-EXPORT_SYMBOL_GPL(bq2589x_set_chargecurrent);
 
-int bq2589x_set_term_current(struct bq2589x *bq, int curr)
+static void bq2589x_adc_filter_reset(struct bq2589x *bq, u32 ch_mask)
 {
-	u8 iterm;
+	int ch;
 
-	iterm = (curr - BQ2589X_ITERM_BASE) / BQ2589X_ITERM_LSB;
+	if (!bq)
+		return;
 
-	return bq2589x_update_bits(bq, BQ2589X_REG_05, BQ2589X_ITERM_MASK, iterm << BQ2589X_ITERM_SHIFT);
+	spin_lock(&bq2589x_adc_lock);
+	for (ch = 0; ch < BQ2589X_CH_NUM; ch++) {
+		if (!(ch_mask & BIT(ch)))
+			continue;
+		bq->adc[ch].count = 0;
+		bq->adc[ch].pos = 0;
+		bq->adc[ch].held = false;
+	}
+	spin_unlock(&bq2589x_adc_lock);
 }
-EXPORT_SYMBOL_GPL(bq2589x_set_term_current);
 
-
-int bq2589x_set_prechg_current(struct bq2589x *bq, int curr)
+/* median of the samples younger than max_age, caller holds the lock */
+static int bq2589x_adc_window_median(struct bq2589x *bq, struct bq2589x_adc_filter *f,
+				unsigned int max_age_ms)
+{
+	int fresh[BQ2589X_ADC_WIN_MAX];
+	int n = 0;
+	int i;
+
+	for (i = 0; i < f->count; i++)
+		if (time_before(jiffies, f->stamp[i] + msecs_to_jiffies(max_age_ms)))
+			fresh[n++] = f->win[i];
+
+	if (n < bq->cfg.adc_window)
+		return -EAGAIN;
+
+	sort(fresh, n, sizeof(int), bq2589x_cmp_int, NULL);
+	return fresh[n / 2];
+}
+
+static void bq2589x_adc_push(struct bq2589x *bq, int ch, int val)
+{
+	struct bq2589x_adc_filter *f = &bq->adc[ch];
+	int med;
+
+	med = bq2589x_adc_window_median(bq, f, bq2589x_adc_max_age(bq));
+	if (med >= 0 && bq2589x_adc_outlier[ch] && abs(val - med) > bq2589x_adc_outlier[ch]) {
+		if (!f->held) {
+			f->held = true;
+			bq->adc_outliers++;
+			return;
+		}
+		f->count = 0;
+		f->pos = 0;
+	}
+	f->held = false;
+
+	f->win[f->pos] = val;
+	f->stamp[f->pos] = jiffies;
+	f->pos = (f->pos + 1) % bq->cfg.adc_window;
+	if (f->count < bq->cfg.adc_window)
+		f->count++;
+	f->last = val;
+
+	/* kept scaled up, a plain divide would stall short of a steady input */
+	if (f->ewma_valid)
+		f->ewma_acc += val - (f->ewma_acc >> bq->cfg.adc_ewma_shift);
+	else
+		f->ewma_acc = val << bq->cfg.adc_ewma_shift;
+	f->ewma_valid = true;
+}
+
+/* one block read of REG0E-12 feeding every channel the part has, period_ms apart */
+static int bq2589x_adc_sample(struct bq2589x *bq, unsigned int period_ms)
+{
+	u8 regs[BQ2589X_CH_NUM];
+	int val[BQ2589X_CH_NUM];
+	int ch;
+	int ret;
+
+	WRITE_ONCE(bq->adc_period_ms, period_ms);
+
+	ret = bq2589x_read_block(bq, BQ2589X_REG_0E, regs, BQ2589X_CH_NUM);
+	if (ret)
+		return ret;
+
+	val[BQ2589X_CH_BATV] = BQ2589X_DECODE(regs[BQ2589X_CH_BATV], BATV);
+	val[BQ2589X_CH_SYSV] = BQ2589X_DECODE(regs[BQ2589X_CH_SYSV], SYSV);
+	val[BQ2589X_CH_TSPCT] = BQ2589X_DECODE(regs[BQ2589X_CH_TSPCT], TSPCT);
+	val[BQ2589X_CH_VBUSV] = BQ2589X_DECODE(regs[BQ2589X_CH_VBUSV], VBUSV);
+	val[BQ2589X_CH_ICHGR] = BQ2589X_DECODE(regs[BQ2589X_CH_ICHGR], ICHGR);
+
+	spin_lock(&bq2589x_adc_lock);
+	for (ch = 0; ch < BQ2589X_CH_NUM; ch++)
+		bq2589x_adc_push(bq, ch, val[ch]);
+	spin_unlock(&bq2589x_adc_lock);
+
+	return 0;
+}
+
+/* median of the recent window, -EAGAIN until it holds enough fresh samples */
+static int bq2589x_adc_median(struct bq2589x *bq, int ch)
+{
+	int ret;
+
+	spin_lock(&bq2589x_adc_lock);
+	ret = bq2589x_adc_window_median(bq, &bq->adc[ch], bq2589x_adc_max_age(bq));
+	spin_unlock(&bq2589x_adc_lock);
+
+	return ret;
+}
+
+static int bq2589x_adc_last(struct bq2589x *bq, int ch)
+{
+	return bq->adc[ch].count ? bq->adc[ch].last : -ENODATA;
+}
+
+static int bq2589x_adc_ewma(struct bq2589x *bq, int ch)
+{
+	return bq->adc[ch].ewma_valid ? bq->adc[ch].ewma_acc >> bq->cfg.adc_ewma_shift : -ENODATA;
+}
+
+/*
+ * Stable reading for a state machine decision: sample now and return
+ * the window median once the window is full of samples taken at the
+ * conversion rate. Until then returns -EAGAIN with the delay to the
+ * next sample.
+ */
+static int bq2589x_adc_stable(struct bq2589x *bq, int ch, unsigned int *delay_ms)
+{
+	int ret;
+
+	ret = bq2589x_adc_sample(bq, bq->cfg.adc_sample_ms);
+	if (ret) {
+		*delay_ms = 1000;
+		return ret;
+	}
+
+	ret = bq2589x_adc_median(bq, ch);
+	if (ret == -EAGAIN)
+		*delay_ms = bq->cfg.adc_sample_ms;
+
+	return ret;
+}
+
+int bq2589x_set_chargecurrent(struct bq2589x *bq, int curr)
+{
+
+	u8 ichg;
+
+	ichg = BQ2589X_ENCODE(min(curr, BQ2589X_ICHG_MAX), ICHG);
+	return bq2589x_update_bits(bq, BQ2589X_REG_04, BQ2589X_ICHG_MASK, ichg);
+
+}
+EXPORT_SYMBOL_GPL(bq2589x_set_chargecurrent);
+
+int bq2589x_set_term_current(struct bq2589x *bq, int curr)
+{
+	u8 iterm;
+
+	iterm = BQ2589X_ENCODE(curr, ITERM);
+
+	return bq2589x_update_bits(bq, BQ2589X_REG_05, BQ2589X_ITERM_MASK, iterm);
+}
+EXPORT_SYMBOL_GPL(bq2589x_set_term_current);
+
+
+int bq2589x_set_prechg_current(struct bq2589x *bq, int curr)
 {
 	u8 iprechg;
 
-	iprechg = (curr - BQ2589X_IPRECHG_BASE) / BQ2589X_IPRECHG_LSB;
+	iprechg = BQ2589X_ENCODE(curr, IPRECHG);
 
-	return bq2589x_update_bits(bq, BQ2589X_REG_05, BQ2589X_IPRECHG_MASK, iprechg << BQ2589X_IPRECHG_SHIFT);
+	return bq2589x_update_bits(bq, BQ2589X_REG_05, BQ2589X_IPRECHG_MASK, iprechg);
 }
 EXPORT_SYMBOL_GPL(bq2589x_set_prechg_current);
 
@@ -416,17 +1135,93 @@ int bq2589x_set_chargevoltage(struct bq2589x *bq, int volt)
 {
 	u8 val;
 
-	val = (volt - BQ2589X_VREG_BASE) / BQ2589X_VREG_LSB;
-	return bq2589x_update_bits(bq, BQ2589X_REG_06, BQ2589X_VREG_MASK, val << BQ2589X_VREG_SHIFT);
+	val = BQ2589X_ENCODE(min(volt, BQ2589X_VREG_MAX), VREG);
+	return bq2589x_update_bits(bq, BQ2589X_REG_06, BQ2589X_VREG_MASK, val);
 }
 EXPORT_SYMBOL_GPL(bq2589x_set_chargevoltage);
 
+int bq2589x_set_ir_comp(struct bq2589x *bq, int mohm, int clamp)
+{
+	u8 val;
+
+	val = BQ2589X_ENCODE(mohm, BAT_COMP) | BQ2589X_ENCODE(clamp, VCLAMP);
+	return bq2589x_update_bits(bq, BQ2589X_REG_08, BQ2589X_BAT_COMP_MASK | BQ2589X_VCLAMP_MASK, val);
+}
+EXPORT_SYMBOL_GPL(bq2589x_set_ir_comp);
+
+/* charger 2 share of the input in permille, minimizing conduction loss */
+static int bq2589x_eff_share(struct bq2589x *bq1, struct bq2589x *bq2)
+{
+	int r1;
+	int r2;
+
+	if (!bq1 || !bq2)
+		return 0;
+
+	r1 = bq1->cfg.eff_res;
+	r2 = bq2->cfg.eff_res;
+	if (!r1 || !r2)
+		return 500;
+
+	return r1 * 1000 / (r1 + r2);
+}
+
+/* this charger's part of a ceiling on the pair */
+static int bq2589x_limit_split(struct bq2589x *bq, int total)
+{
+	struct bq2589x *bq2 = READ_ONCE(g_bq2);
+
+	if (!bq2)
+		return total;
+	if (bq != g_bq1)
+		return total * bq2589x_eff_share(g_bq1, bq2) / 1000;
+
+	return bq2->enabled ? total - total * bq2589x_eff_share(g_bq1, bq2) / 1000 : total;
+}
+
+/* the ceilings as one consistent set, property writes may land meanwhile */
+static struct limits_ctrl bq2589x_ulim_get(void)
+{
+	struct limits_ctrl l;
+
+	spin_lock(&bq2589x_ulim_lock);
+	l = ulim;
+	spin_unlock(&bq2589x_ulim_lock);
+
+	return l;
+}
+
+/*
+ * Policy sets ICHG, VREG and IINLIM through these. The userspace ceiling
+ * and JEITA derating are applied on the way to the chip, so either can
+ * change and be re-applied on its own.
+ */
+static int bq2589x_request_ichg(struct bq2589x *bq, int curr)
+{
+	struct limits_ctrl l = bq2589x_ulim_get();
+
+	bq->ichg_req = curr;
+	if (l.ichg >= 0)
+		curr = min(curr, bq2589x_limit_split(bq, l.ichg));
+	return bq2589x_set_chargecurrent(bq, curr * jeita.ichg_pm / 1000);
+}
+
+static int bq2589x_request_vreg(struct bq2589x *bq, int volt)
+{
+	struct limits_ctrl l = bq2589x_ulim_get();
+
+	bq->vreg_req = volt;
+	if (l.vreg >= 0)
+		volt = min(volt, l.vreg);
+	return bq2589x_set_chargevoltage(bq, volt - jeita.vreg_drop);
+}
+
 
 int bq2589x_set_input_volt_limit(struct bq2589x *bq, int volt)
 {
 	u8 val;
-	val = (volt - BQ2589X_VINDPM_BASE) / BQ2589X_VINDPM_LSB;
-	return bq2589x_update_bits(bq, BQ2589X_REG_0D, BQ2589X_VINDPM_MASK, val << BQ2589X_VINDPM_SHIFT);
+	val = BQ2589X_ENCODE(volt, VINDPM);
+	return bq2589x_update_bits(bq, BQ2589X_REG_0D, BQ2589X_VINDPM_MASK, val);
 }
 EXPORT_SYMBOL_GPL(bq2589x_set_input_volt_limit);
 
@@ -435,18 +1230,28 @@ int bq2589x_set_input_current_limit(struct bq2589x *bq, int curr)
 
 	u8 val;
 
-	val = (curr - BQ2589X_IINLIM_BASE) / BQ2589X_IINLIM_LSB;
-	return bq2589x_update_bits(bq, BQ2589X_REG_00, BQ2589X_IINLIM_MASK, val << BQ2589X_IINLIM_SHIFT);
+	val = BQ2589X_ENCODE(min(curr, BQ2589X_IINLIM_MAX), IINLIM);
+	return bq2589x_update_bits(bq, BQ2589X_REG_00, BQ2589X_IINLIM_MASK, val);
 }
 EXPORT_SYMBOL_GPL(bq2589x_set_input_current_limit);
 
+static int bq2589x_request_iinlim(struct bq2589x *bq, int curr)
+{
+	struct limits_ctrl l = bq2589x_ulim_get();
+
+	bq->iinlim_req = curr;
+	if (l.iinlim >= 0)
+		curr = min(curr, bq2589x_limit_split(bq, l.iinlim));
+	return bq2589x_set_input_current_limit(bq, curr);
+}
+
 
 int bq2589x_set_vindpm_offset(struct bq2589x *bq, int offset)
 {
 	u8 val;
 
-	val = (offset - BQ2589X_VINDPMOS_BASE) / BQ2589X_VINDPMOS_LSB;
-	return bq2589x_update_bits(bq, BQ2589X_REG_01, BQ2589X_VINDPMOS_MASK, val << BQ2589X_VINDPMOS_SHIFT);
+	val = BQ2589X_ENCODE(offset, VINDPMOS);
+	return bq2589x_update_bits(bq, BQ2589X_REG_01, BQ2589X_VINDPMOS_MASK, val);
 }
 EXPORT_SYMBOL_GPL(bq2589x_set_vindpm_offset);
 
@@ -479,27 +1284,22 @@ int bq2589x_get_charging_status(struct bq2589x *bq)
 }
 EXPORT_SYMBOL_GPL(bq2589x_get_charging_status);
 
+static int bq2589x_otg_switch(struct bq2589x *bq, bool enable);
+
 void bq2589x_set_otg(struct bq2589x *bq, int enable)
 {
 	int ret;
 
-	if (enable) {
-		ret = bq2589x_enable_otg(bq);
-		if (ret < 0) {
-			dev_err(bq->dev, "%s:Failed to enable otg-%d\n", __func__, ret);
-			return;
-		}
-	} else {
-		ret = bq2589x_disable_otg(bq);
-		if (ret < 0)
-			dev_err(bq->dev, "%s:Failed to disable otg-%d\n", __func__, ret);
-	}
+	ret = bq2589x_otg_switch(bq, !!enable);
+	if (ret < 0)
+		dev_err(bq->dev, "%s:Failed to %s otg-%d\n", __func__,
+			enable ? "enable" : "disable", ret);
 }
 EXPORT_SYMBOL_GPL(bq2589x_set_otg);
 
 int bq2589x_set_watchdog_timer(struct bq2589x *bq, u8 timeout)
 {
-	return bq2589x_update_bits(bq, BQ2589X_REG_07, BQ2589X_WDT_MASK, (u8)((timeout - BQ2589X_WDT_BASE) / BQ2589X_WDT_LSB) << BQ2589X_WDT_SHIFT);
+	return bq2589x_update_bits(bq, BQ2589X_REG_07, BQ2589X_WDT_MASK, BQ2589X_ENCODE(timeout, WDT));
 }
 EXPORT_SYMBOL_GPL(bq2589x_set_watchdog_timer);
 
@@ -519,11 +1319,35 @@ int bq2589x_reset_watchdog_timer(struct bq2589x *bq)
 }
 EXPORT_SYMBOL_GPL(bq2589x_reset_watchdog_timer);
 
+/*
+ * Charger 1 runs with the watchdog only while monitor_work is there to
+ * kick it, i.e. for the length of a charge session. Left armed while
+ * idle it would expire every 160s and reset the chip to its defaults.
+ */
+static void bq2589x_watchdog_arm(struct bq2589x *bq, bool arm)
+{
+	int ret;
+
+	if (arm) {
+		ret = bq2589x_set_watchdog_timer(bq, 160);
+		if (!ret)
+			ret = bq2589x_reset_watchdog_timer(bq);
+	} else {
+		ret = bq2589x_disable_watchdog_timer(bq);
+	}
+	if (ret < 0)
+		dev_err(bq->dev, "%s:Failed to %s watchdog timer:%d\n", __func__,
+			arm ? "arm" : "disable", ret);
+}
+
 int bq2589x_force_dpdm(struct bq2589x *bq)
 {
 	int ret;
 	u8 val = BQ2589X_FORCE_DPDM << BQ2589X_FORCE_DPDM_SHIFT;
 
+	if (!bq2589x_has(bq, BQ2589X_FEAT_DPDM))
+		return -EOPNOTSUPP;
+
 	ret = bq2589x_update_bits(bq, BQ2589X_REG_02, BQ2589X_FORCE_DPDM_MASK, val);
 	if (ret)
 		return ret;
@@ -540,6 +1364,13 @@ int bq2589x_reset_chip(struct bq2589x *bq)
 	u8 val = BQ2589X_RESET << BQ2589X_RESET_SHIFT;
 
 	ret = bq2589x_update_bits(bq, BQ2589X_REG_14, BQ2589X_RESET_MASK, val);
+	if (ret)
+		return ret;
+
+	/* back to defaults now, reapply the intended configuration */
+	if (bq->shadow_loaded)
+		ret = bq2589x_shadow_apply(bq);
+
 	return ret;
 }
 EXPORT_SYMBOL_GPL(bq2589x_reset_chip);
@@ -612,6 +1443,9 @@ int bq2589x_pumpx_enable(struct bq2589x *bq, int enable)
 	u8 val;
 	int ret;
 
+	if (!bq2589x_has(bq, BQ2589X_FEAT_PUMPX))
+		return enable ? -EOPNOTSUPP : 0;
+
 	if (enable)
 		val = BQ2589X_PUMPX_ENABLE << BQ2589X_EN_PUMPX_SHIFT;
 	else
@@ -628,6 +1462,9 @@ int bq2589x_pumpx_increase_volt(struct bq2589x *bq)
 	u8 val;
 	int ret;
 
+	if (!bq2589x_has(bq, BQ2589X_FEAT_PUMPX))
+		return -EOPNOTSUPP;
+
 	val = BQ2589X_PUMPX_UP << BQ2589X_PUMPX_UP_SHIFT;
 
 	ret = bq2589x_update_bits(bq, BQ2589X_REG_09, BQ2589X_PUMPX_UP_MASK, val);
@@ -659,6 +1496,9 @@ int bq2589x_pumpx_decrease_volt(struct bq2589x *bq)
 	u8 val;
 	int ret;
 
+	if (!bq2589x_has(bq, BQ2589X_FEAT_PUMPX))
+		return -EOPNOTSUPP;
+
 	val = BQ2589X_PUMPX_DOWN << BQ2589X_PUMPX_DOWN_SHIFT;
 
 	ret = bq2589x_update_bits(bq, BQ2589X_REG_09, BQ2589X_PUMPX_DOWN_MASK, val);
@@ -690,6 +1530,9 @@ static int bq2589x_force_ico(struct bq2589x *bq)
 	u8 val;
 	int ret;
 
+	if (!bq2589x_has(bq, BQ2589X_FEAT_ICO))
+		return -EOPNOTSUPP;
+
 	val = BQ2589X_FORCE_ICO << BQ2589X_FORCE_ICO_SHIFT;
 
 	ret = bq2589x_update_bits(bq, BQ2589X_REG_09, BQ2589X_FORCE_ICO_MASK, val);
@@ -734,6 +1577,9 @@ static int bq2589x_enable_auto_dpdm(struct bq2589x* bq, bool enable)
 	u8 val;
 	int ret;
 	
+	if (!bq2589x_has(bq, BQ2589X_FEAT_DPDM))
+		return enable ? -EOPNOTSUPP : 0;
+
 	if (enable)
 		val = BQ2589X_AUTO_DPDM_ENABLE << BQ2589X_AUTO_DPDM_EN_SHIFT;
 	else
@@ -768,6 +1614,9 @@ static int bq2589x_enable_ico(struct bq2589x* bq, bool enable)
 	u8 val;
 	int ret;
 	
+	if (!bq2589x_has(bq, BQ2589X_FEAT_ICO))
+		return enable ? -EOPNOTSUPP : 0;
+
 	if (enable)
 		val = BQ2589X_ICO_ENABLE << BQ2589X_ICOEN_SHIFT;
 	else
@@ -790,7 +1639,7 @@ static int bq2589x_read_idpm_limit(struct bq2589x *bq)
 		dev_err(bq->dev, "read vbus voltage failed :%d\n", ret);
 		return ret;
 	} else {
-		curr = BQ2589X_IDPM_LIM_BASE + ((val & BQ2589X_IDPM_LIM_MASK) >> BQ2589X_IDPM_LIM_SHIFT) * BQ2589X_IDPM_LIM_LSB ;
+		curr = BQ2589X_DECODE(val, IDPM_LIM);
 		return curr;
 	}
 }
@@ -813,22 +1662,45 @@ static bool bq2589x_is_charge_done(struct bq2589x *bq)
 }
 EXPORT_SYMBOL_GPL(bq2589x_is_charge_done);
 
-static int bq2589x_init_device(struct bq2589x *bq)
-{
+#define BQ2589X_VINDPMOS_MARK	600	/* mV, POR default is 500, see bq2589x_configured() */
 
+static int bq2589x_init_config(struct bq2589x *bq)
+{
 	int ret;
 
 	/*common initialization*/
 
-	bq2589x_disable_watchdog_timer(bq);
+	ret = bq2589x_disable_watchdog_timer(bq);
+	if (ret < 0) {
+		dev_err(bq->dev, "%s:Failed to disable watchdog timer:%d\n", __func__, ret);
+		return ret;
+	}
+
+	ret = bq2589x_enable_auto_dpdm(bq, bq->cfg.enable_auto_dpdm);
+	if (ret < 0) {
+		dev_err(bq->dev, "%s:Failed to set auto dpdm:%d\n", __func__, ret);
+		return ret;
+	}
+
+	ret = bq2589x_enable_term(bq, bq->cfg.enable_term);
+	if (ret < 0) {
+		dev_err(bq->dev, "%s:Failed to set termination:%d\n", __func__, ret);
+		return ret;
+	}
 
-	bq2589x_enable_auto_dpdm(bq, bq->cfg.enable_auto_dpdm);
-	bq2589x_enable_term(bq, bq->cfg.enable_term);
-	bq2589x_enable_ico(bq, bq->cfg.enable_ico);
-	bq2589x_enable_absolute_vindpm(bq, bq->cfg.enable_absolute_vindpm);
+	ret = bq2589x_enable_ico(bq, bq->cfg.enable_ico);
+	if (ret < 0) {
+		dev_err(bq->dev, "%s:Failed to set ico:%d\n", __func__, ret);
+		return ret;
+	}
 
+	ret = bq2589x_enable_absolute_vindpm(bq, bq->cfg.enable_absolute_vindpm);
+	if (ret < 0) {
+		dev_err(bq->dev, "%s:Failed to set absolute vindpm:%d\n", __func__, ret);
+		return ret;
+	}
 
-	ret = bq2589x_set_vindpm_offset(bq, 600);
+	ret = bq2589x_set_vindpm_offset(bq, BQ2589X_VINDPMOS_MARK);
 	if (ret < 0) {
 		dev_err(bq->dev, "%s:Failed to set vindpm offset:%d\n", __func__, ret);
 		return ret;
@@ -840,13 +1712,13 @@ static int bq2589x_init_device(struct bq2589x *bq)
 		return ret;
 	}
 
-	ret = bq2589x_set_chargevoltage(bq, bq->cfg.charge_voltage);
+	ret = bq2589x_request_vreg(bq, bq->cfg.charge_voltage);
 	if (ret < 0) {
 		dev_err(bq->dev, "%s:Failed to set charge voltage:%d\n", __func__, ret);
 		return ret;
 	}
 
-	ret = bq2589x_set_chargecurrent(bq, bq->cfg.charge_current);
+	ret = bq2589x_request_ichg(bq, bq->cfg.charge_current);
 	if (ret < 0) {
 		dev_err(bq->dev, "%s:Failed to set charge current:%d\n", __func__, ret);
 		return ret;
@@ -858,21 +1730,27 @@ static int bq2589x_init_device(struct bq2589x *bq)
 		return ret;
 	}
 
-	bq2589x_disable_ilim_pin(bq);
+	ret = bq2589x_disable_ilim_pin(bq);
+	if (ret < 0) {
+		dev_err(bq->dev, "%s:Failed to disable ilim pin:%d\n", __func__, ret);
+		return ret;
+	}
 
-	bq2589x_adc_start(bq, false);
+	ret = bq2589x_adc_start(bq, false);
+	if (ret < 0) {
+		dev_err(bq->dev, "%s:Failed to start adc:%d\n", __func__, ret);
+		return ret;
+	}
 
-	if (bq == g_bq1) {/* charger 1 specific initialization*/
+	if (bq->primary) {/* charger 1 specific initialization*/
 
-		ret = bq2589x_pumpx_enable(bq, 1);
+		ret = bq2589x_pumpx_enable(bq, bq2589x_has(bq, BQ2589X_FEAT_PUMPX) ? 1 : 0);
 		if (ret) {
 			dev_err(bq->dev, "%s:Failed to enable pumpx:%d\n", __func__, ret);
 			return ret;
 		}
 
-		bq2589x_set_watchdog_timer(bq, 160);
-
-	} else if (bq == g_bq2) {/*charger2 specific initialization*/
+	} else {/*charger2 specific initialization*/
 		ret = bq2589x_enter_hiz_mode(bq);
 		if (ret < 0) {
 			dev_err(bq->dev, "%s:Failed to enter hiz charger 2:%d\n", __func__, ret);
@@ -884,15 +1762,74 @@ static int bq2589x_init_device(struct bq2589x *bq)
 	return ret;
 }
 
+/*
+ * The VINDPM offset this driver programs differs from the 500mV
+ * power-on default and nothing else writes it, so a chip that still
+ * holds it was set up by a previous instance; a POR, a watchdog expiry
+ * or a chip reset put the default back. The watchdog field can't serve:
+ * charger 2 runs with it disabled and never expires.
+ */
+static bool bq2589x_configured(u8 reg01)
+{
+	return BQ2589X_DECODE(reg01, VINDPMOS) == BQ2589X_VINDPMOS_MARK;
+}
 
-static int bq2589x_charge_status(struct bq2589x *bq)
+BQ2589X_VISIBLE int bq2589x_init_device(struct bq2589x *bq)
 {
-	u8 val = 0;
+	u8 live[BQ2589X_SHADOW_NUM];
+	int ret;
 
-	bq2589x_read_byte(bq, &val, BQ2589X_REG_0B);
-	val &= BQ2589X_CHRG_STAT_MASK;
-	val >>= BQ2589X_CHRG_STAT_SHIFT;
-	switch (val) {
+	ret = bq2589x_shadow_load(bq);
+	if (ret < 0) {
+		dev_err(bq->dev, "%s:Failed to read registers:%d\n", __func__, ret);
+		return ret;
+	}
+	memcpy(live, bq->shadow, sizeof(live));
+	bq->warm = bq2589x_configured(live[BQ2589X_REG_01]);
+
+	/* stage the whole configuration in the shadow, then write the difference */
+	bq2589x_stage_begin(bq);
+	ret = bq2589x_init_config(bq);
+	if (ret < 0) {
+		bq2589x_stage_end(bq, false);
+		return ret;
+	}
+
+	/*
+	 * Still set up by the previous kernel or module instance: keep what
+	 * the charging policy had negotiated rather than the probe defaults,
+	 * so a reboot on the adapter doesn't drop charging power.
+	 */
+	if (bq->warm) {
+		bq->shadow[BQ2589X_REG_00] = (bq->shadow[BQ2589X_REG_00] & BQ2589X_ENILIM_MASK)
+			| (live[BQ2589X_REG_00] & (BQ2589X_ENHIZ_MASK | BQ2589X_IINLIM_MASK));
+		bq->shadow[BQ2589X_REG_04] = (bq->shadow[BQ2589X_REG_04] & ~BQ2589X_ICHG_MASK)
+			| (live[BQ2589X_REG_04] & BQ2589X_ICHG_MASK);
+		bq->shadow[BQ2589X_REG_0D] = (bq->shadow[BQ2589X_REG_0D] & ~BQ2589X_VINDPM_MASK)
+			| (live[BQ2589X_REG_0D] & BQ2589X_VINDPM_MASK);
+		bq->ichg_req = BQ2589X_DECODE(live[BQ2589X_REG_04], ICHG);
+		dev_info(bq->dev, "%s:warm start, keeping iinlim %dmA, ichg %dmA%s\n", __func__,
+			BQ2589X_DECODE(live[BQ2589X_REG_00], IINLIM),
+			BQ2589X_DECODE(live[BQ2589X_REG_04], ICHG),
+			(live[BQ2589X_REG_00] & BQ2589X_ENHIZ_MASK) ? ", hiz" : "");
+	}
+	bq->iinlim_req = BQ2589X_DECODE(bq->shadow[BQ2589X_REG_00], IINLIM);
+
+	ret = bq2589x_stage_end(bq, true);
+	if (ret < 0) {
+		dev_err(bq->dev, "%s:Failed to apply configuration:%d\n", __func__, ret);
+		return ret;
+	}
+
+	bq->shadow_loaded = true;
+
+	return 0;
+}
+
+
+static int bq2589x_charge_type(u8 chrg_stat)
+{
+	switch (chrg_stat) {
 	case BQ2589X_CHRG_STAT_FASTCHG:
 		return POWER_SUPPLY_CHARGE_TYPE_FAST;
 	case BQ2589X_CHRG_STAT_PRECHG:
@@ -908,16 +1845,138 @@ static int bq2589x_charge_status(struct bq2589x *bq)
 static enum power_supply_property bq2589x_charger_props[] = {
 	POWER_SUPPLY_PROP_CHARGE_TYPE, /* Charger status output */
 	POWER_SUPPLY_PROP_ONLINE, /* External power source */
+	POWER_SUPPLY_PROP_CONSTANT_CHARGE_CURRENT,
+	POWER_SUPPLY_PROP_CONSTANT_CHARGE_CURRENT_MAX,
+	POWER_SUPPLY_PROP_INPUT_CURRENT_LIMIT,
+	POWER_SUPPLY_PROP_CONSTANT_CHARGE_VOLTAGE,
 };
 
+/* what the pair can take at most, ICHG or IINLIM */
+static int bq2589x_pair_max(bool input)
+{
+	int n = READ_ONCE(g_bq2) ? 2 : 1;
+
+	return n * (input ? BQ2589X_IINLIM_MAX : BQ2589X_ICHG_MAX);
+}
+
+/*
+ * Limit properties, the same on both supplies since they bound the pair.
+ * Reads report what is programmed (the ceiling for CURRENT_MAX), writes
+ * set a ceiling and leave the register update to the limits work.
+ */
+static int bq2589x_limit_get_property(enum power_supply_property psp,
+				union power_supply_propval *val)
+{
+	struct bq2589x *chg[] = { g_bq1, NULL };
+	struct limits_ctrl l;
+	int sum = 0;
+	u8 reg;
+	int i;
+
+	switch (psp) {
+	case POWER_SUPPLY_PROP_CONSTANT_CHARGE_CURRENT:
+	case POWER_SUPPLY_PROP_INPUT_CURRENT_LIMIT:
+		mutex_lock(&bq2589x_chg2_lock);
+		chg[1] = g_bq2;
+		for (i = 0; i < ARRAY_SIZE(chg); i++) {
+			if (!chg[i] || (i && !chg[i]->enabled))
+				continue;
+			bq2589x_reg_lock(chg[i]);
+			if (psp == POWER_SUPPLY_PROP_INPUT_CURRENT_LIMIT)
+				sum += BQ2589X_DECODE(chg[i]->shadow[BQ2589X_REG_00], IINLIM);
+			else
+				sum += BQ2589X_DECODE(chg[i]->shadow[BQ2589X_REG_04], ICHG);
+			bq2589x_reg_unlock(chg[i]);
+		}
+		mutex_unlock(&bq2589x_chg2_lock);
+		val->intval = sum * 1000;
+		break;
+	case POWER_SUPPLY_PROP_CONSTANT_CHARGE_CURRENT_MAX:
+		l = bq2589x_ulim_get();
+		val->intval = (l.ichg >= 0 ? l.ichg : bq2589x_pair_max(false)) * 1000;
+		break;
+	case POWER_SUPPLY_PROP_CONSTANT_CHARGE_VOLTAGE:
+		bq2589x_reg_lock(g_bq1);
+		reg = g_bq1->shadow[BQ2589X_REG_06];
+		bq2589x_reg_unlock(g_bq1);
+		val->intval = BQ2589X_DECODE(reg, VREG) * 1000;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int bq2589x_limit_set_property(enum power_supply_property psp,
+				const union power_supply_propval *val)
+{
+	int v = val->intval / 1000;
+
+	switch (psp) {
+	case POWER_SUPPLY_PROP_CONSTANT_CHARGE_CURRENT:
+	case POWER_SUPPLY_PROP_CONSTANT_CHARGE_CURRENT_MAX:
+		if (v < 0 || v > bq2589x_pair_max(false))
+			return -EINVAL;
+		spin_lock(&bq2589x_ulim_lock);
+		ulim.ichg = v;
+		spin_unlock(&bq2589x_ulim_lock);
+		break;
+	case POWER_SUPPLY_PROP_INPUT_CURRENT_LIMIT:
+		if (v < BQ2589X_IINLIM_BASE || v > bq2589x_pair_max(true))
+			return -EINVAL;
+		spin_lock(&bq2589x_ulim_lock);
+		ulim.iinlim = v;
+		spin_unlock(&bq2589x_ulim_lock);
+		break;
+	case POWER_SUPPLY_PROP_CONSTANT_CHARGE_VOLTAGE:
+		/* lowering only, DT charge-voltage is what the pack is rated for */
+		if (v < BQ2589X_VREG_BASE || v > g_bq1->cfg.charge_voltage)
+			return -EINVAL;
+		spin_lock(&bq2589x_ulim_lock);
+		ulim.vreg = v;
+		spin_unlock(&bq2589x_ulim_lock);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	/* already pending: this write rides along with the earlier ones */
+	schedule_delayed_work(&g_bq1->limits_work, msecs_to_jiffies(BQ2589X_LIMITS_BATCH_MS));
+
+	return 0;
+}
 
+static int bq2589x_property_is_writeable(struct power_supply *psy,
+				enum power_supply_property psp)
+{
+	switch (psp) {
+	case POWER_SUPPLY_PROP_CONSTANT_CHARGE_CURRENT:
+	case POWER_SUPPLY_PROP_CONSTANT_CHARGE_CURRENT_MAX:
+	case POWER_SUPPLY_PROP_INPUT_CURRENT_LIMIT:
+	case POWER_SUPPLY_PROP_CONSTANT_CHARGE_VOLTAGE:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static int bq2589x_set_property(struct power_supply *psy,
+				enum power_supply_property psp,
+				const union power_supply_propval *val)
+{
+	return bq2589x_limit_set_property(psp, val);
+}
+
+
+/* served from state the interrupt path keeps current, no i2c on a poll */
 static int bq2589x_usb_get_property(struct power_supply *psy,
 				enum power_supply_property psp,
 				union power_supply_propval *val)
 {
 
 	struct bq2589x *bq = container_of(psy, struct bq2589x, usb);
-	u8 type = bq2589x_get_vbus_type(bq);
+	int type = (bq->status & BQ2589X_STATUS_PLUGIN) ? bq->vbus_type : BQ2589X_VBUS_NONE;
 
 	switch (psp) {
 	case POWER_SUPPLY_PROP_ONLINE:
@@ -927,10 +1986,10 @@ static int bq2589x_usb_get_property(struct power_supply *psy,
 			val->intval = 0;
 		break;
 	case POWER_SUPPLY_PROP_CHARGE_TYPE:
-		val->intval = bq2589x_charge_status(bq);
+		val->intval = bq2589x_charge_type(bq->chrg_stat);
 		break;
 	default:
-		return -EINVAL;
+		return bq2589x_limit_get_property(psp, val);
 	}
 
 	return 0;
@@ -942,7 +2001,7 @@ static int bq2589x_wall_get_property(struct power_supply *psy,
 {
 
 	struct bq2589x *bq = container_of(psy, struct bq2589x, wall);
-	u8 type = bq2589x_get_vbus_type(bq);
+	int type = (bq->status & BQ2589X_STATUS_PLUGIN) ? bq->vbus_type : BQ2589X_VBUS_NONE;
 
 	switch (psp) {
 	case POWER_SUPPLY_PROP_ONLINE:
@@ -952,10 +2011,10 @@ static int bq2589x_wall_get_property(struct power_supply *psy,
 			val->intval = 0;
 		break;
 	case POWER_SUPPLY_PROP_CHARGE_TYPE:
-		val->intval = bq2589x_charge_status(bq);
+		val->intval = bq2589x_charge_type(bq->chrg_stat);
 		break;
 	default:
-		return -EINVAL;
+		return bq2589x_limit_get_property(psp, val);
 	}
 
 	return 0;
@@ -970,6 +2029,8 @@ static int bq2589x_psy_register(struct bq2589x *bq)
 	bq->usb.properties = bq2589x_charger_props;
 	bq->usb.num_properties = ARRAY_SIZE(bq2589x_charger_props);
 	bq->usb.get_property = bq2589x_usb_get_property;
+	bq->usb.set_property = bq2589x_set_property;
+	bq->usb.property_is_writeable = bq2589x_property_is_writeable;
 	bq->usb.external_power_changed = NULL;
 
 	ret = power_supply_register(bq->dev, &bq->usb);
@@ -984,6 +2045,8 @@ static int bq2589x_psy_register(struct bq2589x *bq)
 	bq->wall.properties = bq2589x_charger_props;
 	bq->wall.num_properties = ARRAY_SIZE(bq2589x_charger_props);
 	bq->wall.get_property = bq2589x_wall_get_property;
+	bq->wall.set_property = bq2589x_set_property;
+	bq->wall.property_is_writeable = bq2589x_property_is_writeable;
 	bq->wall.external_power_changed = NULL;
 
 	ret = power_supply_register(bq->dev, &bq->wall);
@@ -1023,6 +2086,10 @@ static ssize_t bq2589x_show_registers(struct device *dev,
 		}
 	}
 
+	mutex_lock(&bq2589x_chg2_lock);
+	if (!g_bq2)
+		goto out;
+
 	idx += snprintf(&buf[idx], PAGE_SIZE - idx, "%s:\n", "Charger 2");
 	for (addr = 0x0; addr <= 0x14; addr++) {
 		ret = bq2589x_read_byte(g_bq2, &val, addr);
@@ -1031,26 +2098,349 @@ static ssize_t bq2589x_show_registers(struct device *dev,
 			idx += len;
 		}
 	}
+out:
+	mutex_unlock(&bq2589x_chg2_lock);
 
 	return idx;
 }
 
-static DEVICE_ATTR(registers, S_IRUGO, bq2589x_show_registers, NULL);
+/* sort the reached samples in place and print n/p50/p90/max */
+static int bq2589x_show_percentiles(char *buf, int size, const char *name, int *samples, int count)
+{
+	int n = 0;
+	int i;
 
-static struct attribute *bq2589x_attributes[] = {
-	&dev_attr_registers.attr,
-	NULL,
-};
+	for (i = 0; i < count; i++)
+		if (samples[i] >= 0)
+			samples[n++] = samples[i];
 
-static const struct attribute_group bq2589x_attr_group = {
-	.attrs = bq2589x_attributes,
-};
+	if (n == 0)
+		return snprintf(buf, size, "  %s: n=0\n", name);
 
+	sort(samples, n, sizeof(int), bq2589x_cmp_int, NULL);
 
-static int bq2589x_parse_dt(struct device *dev, struct bq2589x *bq)
+	return snprintf(buf, size, "  %s: n=%d p50=%d p90=%d max=%d\n", name, n,
+			samples[(n - 1) / 2], samples[(n - 1) * 9 / 10], samples[n - 1]);
+}
+
+BQ2589X_VISIBLE ssize_t bq2589x_show_bringup_stats(struct device *dev,
+				struct device_attribute *attr, char *buf)
 {
-	int ret;
-	struct device_node *np = dev->of_node;
+	struct bq2589x_bringup_hist *hist;
+	int samples[BQ2589X_BRINGUP_HISTORY];
+	int idx = 0;
+	int cls;
+	int i, j;
+
+	mutex_lock(&bq2589x_bringup_lock);
+	for (cls = 0; cls < BQ2589X_BRINGUP_CLASS_NUM; cls++) {
+		hist = &bringup.hist[cls];
+		if (!hist->count)
+			continue;
+
+		idx += snprintf(&buf[idx], PAGE_SIZE - idx, "class=%s sessions=%d\n",
+				bq2589x_class_name[cls], hist->count);
+
+		for (j = 0; j < BQ2589X_MARK_NUM; j++) {
+			for (i = 0; i < hist->count; i++)
+				samples[i] = hist->mark_ms[i][j];
+			idx += bq2589x_show_percentiles(&buf[idx], PAGE_SIZE - idx,
+					bq2589x_mark_name[j], samples, hist->count);
+		}
+
+		memcpy(samples, hist->e2e_ms, sizeof(samples));
+		idx += bq2589x_show_percentiles(&buf[idx], PAGE_SIZE - idx, "end_to_end", samples, hist->count);
+
+		memcpy(samples, hist->xfers, sizeof(samples));
+		idx += bq2589x_show_percentiles(&buf[idx], PAGE_SIZE - idx, "i2c_xfers", samples, hist->count);
+	}
+	mutex_unlock(&bq2589x_bringup_lock);
+
+	return idx;
+}
+
+static ssize_t bq2589x_store_bringup_stats(struct device *dev,
+				struct device_attribute *attr, const char *buf, size_t count)
+{
+	mutex_lock(&bq2589x_bringup_lock);
+	memset(bringup.hist, 0, sizeof(bringup.hist));
+	mutex_unlock(&bq2589x_bringup_lock);
+
+	return count;
+}
+
+static ssize_t bq2589x_show_sm_stats(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	ssize_t len;
+
+	mutex_lock(&bq2589x_chg2_lock);
+	len = snprintf(buf, PAGE_SIZE, "state=%s dual=%d session=%u wakeups=%u transitions=%u i2c_xfers=%u peak_xfers=%u\n",
+			bq2589x_sm_state_name[sm.state], g_bq2 && g_bq2->enabled,
+			sm.session, sm.wakeups, sm.transitions,
+			bq2589x_total_xfers() - sm.xfer_base, sm.peak_xfers);
+	mutex_unlock(&bq2589x_chg2_lock);
+
+	return len;
+}
+
+static ssize_t bq2589x_show_session_acct(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	u64 energy;
+	int idx;
+	int i;
+
+	mutex_lock(&bq2589x_acct_lock);
+	energy = acct.energy[0] + acct.energy[1];
+	idx = snprintf(buf, PAGE_SIZE, "duration_s=%llu avg_mw=%llu peak_mw=%d\n",
+			div_u64(acct.total_ms, 1000),
+			acct.total_ms ? div64_u64(energy, acct.total_ms * 1000) : 0,
+			acct.peak_mw);
+	for (i = 0; i < 2; i++)
+		idx += snprintf(&buf[idx], PAGE_SIZE - idx, "charger%d mah=%llu mwh=%llu\n", i + 1,
+				div_u64(acct.charge[i], 3600000),
+				div64_u64(acct.energy[i], 3600000000ULL));
+	for (i = 0; i < BQ2589X_PHASE_NUM; i++)
+		idx += snprintf(&buf[idx], PAGE_SIZE - idx, "%s_s=%llu\n", bq2589x_phase_name[i],
+				div_u64(acct.phase_ms[i], 1000));
+	mutex_unlock(&bq2589x_acct_lock);
+
+	return idx;
+}
+
+static ssize_t bq2589x_show_i2c_errors(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct bq2589x *chg[] = { g_bq1, NULL };
+	int idx = 0;
+	int i;
+
+	mutex_lock(&bq2589x_chg2_lock);
+	chg[1] = g_bq2;
+	mutex_lock(&bq2589x_i2c_lock);
+	for (i = 0; i < ARRAY_SIZE(chg); i++) {
+		if (!chg[i])
+			continue;
+		idx += snprintf(&buf[idx], PAGE_SIZE - idx,
+				"charger%d xfers=%u errors=%u retried=%u failures=%u recoveries=%u\n",
+				i + 1, chg[i]->xfer_count, chg[i]->i2c_errors, chg[i]->i2c_retried,
+				chg[i]->i2c_failures, chg[i]->i2c_recoveries);
+	}
+	mutex_unlock(&bq2589x_i2c_lock);
+	mutex_unlock(&bq2589x_chg2_lock);
+
+	return idx;
+}
+
+static ssize_t bq2589x_show_adapter_cache(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct bq2589x_adapter_entry *e;
+	int idx = 0;
+	int i;
+
+	mutex_lock(&bq2589x_cache_lock);
+	for (i = 0; i < BQ2589X_ADAPTER_CACHE_SIZE; i++) {
+		e = &acache.entry[i];
+		if (!e->valid)
+			continue;
+		idx += snprintf(&buf[idx], PAGE_SIZE - idx,
+				"%d type=%s idle_vbus=%d pe_volt=%d ico=%d hits=%u age=%u\n",
+				i, bq2589x_class_name[e->vbus_type], e->idle_vbus, e->pe_volt,
+				e->ico_ma, e->hits, acache.seq - e->last_used);
+	}
+	mutex_unlock(&bq2589x_cache_lock);
+
+	return idx;
+}
+
+static ssize_t bq2589x_store_adapter_cache(struct device *dev,
+				struct device_attribute *attr, const char *buf, size_t count)
+{
+	mutex_lock(&bq2589x_cache_lock);
+	memset(acache.entry, 0, sizeof(acache.entry));
+	mutex_unlock(&bq2589x_cache_lock);
+
+	return count;
+}
+
+static ssize_t bq2589x_show_source_cap(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "%d %d\n", READ_ONCE(g_bq1->src_volt),
+			READ_ONCE(g_bq1->src_curr));
+}
+
+/* stand-in publisher for boards without a port controller driver */
+static ssize_t bq2589x_store_source_cap(struct device *dev,
+				struct device_attribute *attr, const char *buf, size_t count)
+{
+	int volt, curr;
+
+	if (sscanf(buf, "%d %d", &volt, &curr) != 2 || volt < 0)
+		return -EINVAL;
+	/* a contract the pair could not measure or draw is not one to act on */
+	if (volt > 0 && (volt > BQ2589X_VBUSV_BASE + BQ2589X_VBUSV_MASK * BQ2589X_VBUSV_LSB
+			 || curr < BQ2589X_IINLIM_BASE || curr > bq2589x_pair_max(true)))
+		return -EINVAL;
+
+	bq2589x_notify_source_cap(volt, curr);
+
+	return count;
+}
+
+static ssize_t bq2589x_show_adc_filter(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	static const char * const name[BQ2589X_CH_NUM] = {
+		"vbat", "vsys", "ts", "vbus", "ichg",
+	};
+	struct bq2589x *chg[] = { g_bq1, NULL };
+	struct bq2589x_adc_filter *f;
+	int idx = 0;
+	int i, ch;
+
+	mutex_lock(&bq2589x_chg2_lock);
+	chg[1] = g_bq2;
+	for (i = 0; i < ARRAY_SIZE(chg); i++) {
+		if (!chg[i])
+			continue;
+		idx += snprintf(&buf[idx], PAGE_SIZE - idx, "charger%d outliers=%u\n",
+				i + 1, chg[i]->adc_outliers);
+		spin_lock(&bq2589x_adc_lock);
+		for (ch = 0; ch < BQ2589X_CH_NUM; ch++) {
+			f = &chg[i]->adc[ch];
+			if (!f->ewma_valid)
+				continue;
+			idx += snprintf(&buf[idx], PAGE_SIZE - idx,
+					"  %s last=%d median=%d ewma=%d\n", name[ch], f->last,
+					bq2589x_adc_window_median(chg[i], f, bq2589x_adc_max_age(chg[i])),
+					f->ewma_acc >> chg[i]->cfg.adc_ewma_shift);
+		}
+		spin_unlock(&bq2589x_adc_lock);
+	}
+	mutex_unlock(&bq2589x_chg2_lock);
+
+	return idx;
+}
+
+static ssize_t bq2589x_show_ir_comp(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return snprintf(buf, PAGE_SIZE, "estimate=%dmOhm samples=%d comp=%dmOhm clamp=%dmV max=%dmOhm\n",
+			ir.est, ir.samples, ir.comp, ir.clamp, ir.max_comp);
+}
+
+static DEVICE_ATTR(registers, S_IRUGO, bq2589x_show_registers, NULL);
+static DEVICE_ATTR(bringup_stats, S_IRUGO | S_IWUSR, bq2589x_show_bringup_stats, bq2589x_store_bringup_stats);
+static DEVICE_ATTR(sm_stats, S_IRUGO, bq2589x_show_sm_stats, NULL);
+static DEVICE_ATTR(session_acct, S_IRUGO, bq2589x_show_session_acct, NULL);
+static DEVICE_ATTR(i2c_errors, S_IRUGO, bq2589x_show_i2c_errors, NULL);
+static DEVICE_ATTR(adc_filter, S_IRUGO, bq2589x_show_adc_filter, NULL);
+static DEVICE_ATTR(ir_comp, S_IRUGO, bq2589x_show_ir_comp, NULL);
+static DEVICE_ATTR(adapter_cache, S_IRUGO | S_IWUSR, bq2589x_show_adapter_cache, bq2589x_store_adapter_cache);
+static DEVICE_ATTR(source_cap, S_IRUGO | S_IWUSR, bq2589x_show_source_cap, bq2589x_store_source_cap);
+
+static struct attribute *bq2589x_attributes[] = {
+	&dev_attr_registers.attr,
+	&dev_attr_bringup_stats.attr,
+	&dev_attr_sm_stats.attr,
+	&dev_attr_session_acct.attr,
+	&dev_attr_i2c_errors.attr,
+	&dev_attr_adc_filter.attr,
+	&dev_attr_ir_comp.attr,
+	&dev_attr_adapter_cache.attr,
+	&dev_attr_source_cap.attr,
+	NULL,
+};
+
+static const struct attribute_group bq2589x_attr_group = {
+	.attrs = bq2589x_attributes,
+};
+
+
+static void bq2589x_parse_thermal(struct device *dev, struct device_node *np)
+{
+	u32 cells[BQ2589X_NTC_MAX * 2];
+	int n;
+	int i;
+
+	n = of_property_count_u32_elems(np, "ti,bq2589x,ntc-table");
+	if (n > 0) {
+		if (n % 2 || n < 4 || n > ARRAY_SIZE(cells)
+		    || of_property_read_u32_array(np, "ti,bq2589x,ntc-table", cells, n)) {
+			dev_err(dev, "%s:bad ntc-table (%d cells), TS not used\n", __func__, n);
+		} else {
+			for (i = 0; i < n / 2; i++) {
+				ntc.mpct[i] = cells[i * 2];
+				ntc.temp[i] = (s32)cells[i * 2 + 1];
+				if (i && (ntc.mpct[i] >= ntc.mpct[i - 1] || ntc.temp[i] <= ntc.temp[i - 1])) {
+					dev_err(dev, "%s:ntc-table not ordered cold to hot, TS not used\n", __func__);
+					break;
+				}
+			}
+			if (i == n / 2)
+				ntc.num = i;
+		}
+	}
+
+	of_property_read_u32(np, "ti,bq2589x,jeita-hysteresis", &jeita.hyst);
+	n = of_property_count_u32_elems(np, "ti,bq2589x,jeita-zones");
+	if (n <= 0)
+		return;
+
+	if (n % 4 || n > BQ2589X_JEITA_MAX * 4
+	    || of_property_read_u32_array(np, "ti,bq2589x,jeita-zones", cells, n)) {
+		dev_err(dev, "%s:bad jeita-zones (%d cells), jeita off\n", __func__, n);
+		return;
+	}
+
+	for (i = 0; i < n / 4; i++) {
+		jeita.zones[i].temp_min = (s32)cells[i * 4];
+		jeita.zones[i].temp_max = (s32)cells[i * 4 + 1];
+		jeita.zones[i].ichg_pm = min_t(u32, cells[i * 4 + 2], 1000);
+		jeita.zones[i].vreg_drop = cells[i * 4 + 3];
+	}
+	jeita.num = n / 4;
+}
+
+static void bq2589x_parse_step_table(struct device *dev, struct device_node *np)
+{
+	u32 cells[BQ2589X_STEP_MAX * BQ2589X_STEP_CELLS];
+	struct bq2589x_step_row *r;
+	int n;
+	int i;
+
+	of_property_read_u32(np, "ti,bq2589x,step-vbat-hysteresis", &step.hyst);
+
+	n = of_property_count_u32_elems(np, "ti,bq2589x,step-charge-table");
+	if (n <= 0)
+		return;
+
+	if (n % BQ2589X_STEP_CELLS || n > ARRAY_SIZE(cells)
+	    || of_property_read_u32_array(np, "ti,bq2589x,step-charge-table", cells, n)) {
+		dev_err(dev, "%s:bad step-charge-table (%d cells), using single setpoint\n", __func__, n);
+		return;
+	}
+
+	for (i = 0; i < n / BQ2589X_STEP_CELLS; i++) {
+		r = &step.rows[i];
+		r->vbat_max = cells[i * BQ2589X_STEP_CELLS];
+		r->temp_min = (s32)cells[i * BQ2589X_STEP_CELLS + 1];
+		r->temp_max = (s32)cells[i * BQ2589X_STEP_CELLS + 2];
+		r->ichg = cells[i * BQ2589X_STEP_CELLS + 3];
+		r->vreg = cells[i * BQ2589X_STEP_CELLS + 4];
+		dev_info(dev, "step %d: vbat<%d temp [%d,%d) ichg %dmA vreg %dmV\n", i,
+			r->vbat_max, r->temp_min, r->temp_max, r->ichg, r->vreg);
+	}
+	step.num = n / BQ2589X_STEP_CELLS;
+}
+
+static int bq2589x_parse_dt(struct device *dev, struct bq2589x *bq)
+{
+	int ret;
+	struct device_node *np = dev->of_node;
 
 	ret = of_property_read_u32(np, "ti,bq2589x,vbus-volt-high-level", &pe.high_volt_level);
 	if (ret)
@@ -1064,10 +2454,55 @@ static int bq2589x_parse_dt(struct device *dev, struct bq2589x *bq)
 	if (ret)
 		return ret;
 
+	if (bq->primary) {
+		of_property_read_u32(np, "ti,bq2589x,chg2-exit-soc", &chg2.exit_soc);
+		of_property_read_u32(np, "ti,bq2589x,chg2-soc-hysteresis", &chg2.soc_hyst);
+		of_property_read_u32(np, "ti,bq2589x,chg2-cv-margin", &chg2.cv_margin);
+		of_property_read_u32(np, "ti,bq2589x,chg2-vbat-hysteresis", &chg2.vbat_hyst);
+		of_property_read_u32(np, "ti,bq2589x,chg2-exit-current", &chg2.exit_current);
+		of_property_read_u32(np, "ti,bq2589x,chg2-taper-step", &chg2.taper_step);
+		of_property_read_u32(np, "ti,bq2589x,chg2-taper-min", &chg2.taper_min);
+		of_property_read_u32(np, "ti,bq2589x,dpm-step", &dpm.step);
+		of_property_read_u32(np, "ti,bq2589x,dpm-vbus-shift", &dpm.vbus_shift);
+		bq2589x_parse_step_table(dev, np);
+		bq2589x_parse_thermal(dev, np);
+		of_property_read_u32(np, "ti,bq2589x,ircomp-max-resistance", &ir.max_comp);
+		of_property_read_u32(np, "ti,bq2589x,ircomp-max-clamp", &ir.max_clamp);
+	}
+
+	bq->cfg.enable_12v = of_property_read_bool(np, "ti,bq2589x,enable-12v");
+	if (bq->cfg.enable_12v) {
+		ret = of_property_read_u32(np, "ti,bq2589x,vbus-volt-12v-level", &pe.high_volt_12v_level);
+		if (ret)
+			return ret;
+	}
+
 	bq->cfg.enable_auto_dpdm = of_property_read_bool(np, "ti,bq2589x,enable-auto-dpdm");
 	bq->cfg.enable_term = of_property_read_bool(np, "ti,bq2589x,enable-termination");
 	bq->cfg.enable_ico = of_property_read_bool(np, "ti,bq2589x,enable-ico");
 	bq->cfg.enable_absolute_vindpm = of_property_read_bool(np, "ti,bq2589x,use-absolute-vindpm");
+	bq->cfg.i2c_bus_recovery = of_property_read_bool(np, "ti,bq2589x,i2c-bus-recovery");
+	/* drop what the detected part cannot do rather than fail on it in init */
+	if (bq->cfg.enable_auto_dpdm && !bq2589x_has(bq, BQ2589X_FEAT_DPDM)) {
+		dev_warn(dev, "%s has no D+/D- detection, ignoring enable-auto-dpdm\n", bq->variant->name);
+		bq->cfg.enable_auto_dpdm = false;
+	}
+	if (bq->cfg.enable_ico && !bq2589x_has(bq, BQ2589X_FEAT_ICO)) {
+		dev_warn(dev, "%s has no ICO, ignoring enable-ico\n", bq->variant->name);
+		bq->cfg.enable_ico = false;
+	}
+	of_property_read_u32(np, "ti,bq2589x,eff-switch-loss", &bq->cfg.eff_sw_loss);
+	of_property_read_u32(np, "ti,bq2589x,eff-resistance", &bq->cfg.eff_res);
+	of_property_read_u32(np, "ti,bq2589x,adc-median-window", &bq->cfg.adc_window);
+	of_property_read_u32(np, "ti,bq2589x,adc-sample-ms", &bq->cfg.adc_sample_ms);
+	of_property_read_u32(np, "ti,bq2589x,adc-ewma-shift", &bq->cfg.adc_ewma_shift);
+	bq->cfg.adc_window = clamp_t(u32, bq->cfg.adc_window, 1, BQ2589X_ADC_WIN_MAX);
+	bq->cfg.adc_sample_ms = max_t(u32, bq->cfg.adc_sample_ms, 100);
+	bq->cfg.adc_ewma_shift = min_t(u32, bq->cfg.adc_ewma_shift, 4);
+
+	/* USB 2.0 default unless the board knows better */
+	bq->cfg.input_current_limit = 500;
+	of_property_read_u32(np, "ti,bq2589x,input-current-limit", &bq->cfg.input_current_limit);
 
 	ret = of_property_read_u32(np, "ti,bq2589x,charge-voltage",&bq->cfg.charge_voltage);
 	if (ret)
@@ -1083,49 +2518,193 @@ static int bq2589x_parse_dt(struct device *dev, struct bq2589x *bq)
 	return 0;
 }
 
-static int bq2589x_detect_device(struct bq2589x *bq)
+BQ2589X_VISIBLE int bq2589x_detect_device(struct bq2589x *bq)
 {
 	int ret;
 	u8 data;
 
+	int i;
+
 	ret = bq2589x_read_byte(bq, &data, BQ2589X_REG_14);
-	if (ret == 0) {
-		bq->part_no = (data & BQ2589X_PN_MASK) >> BQ2589X_PN_SHIFT;
-		bq->revision = (data & BQ2589X_DEV_REV_MASK) >> BQ2589X_DEV_REV_SHIFT;
+	if (ret)
+		return ret;
+
+	bq->part_no = (data & BQ2589X_PN_MASK) >> BQ2589X_PN_SHIFT;
+	bq->revision = (data & BQ2589X_DEV_REV_MASK) >> BQ2589X_DEV_REV_SHIFT;
+
+	for (i = 0; i < ARRAY_SIZE(bq2589x_variants); i++) {
+		if (bq2589x_variants[i].pn == bq->part_no) {
+			bq->variant = &bq2589x_variants[i];
+			return 0;
+		}
 	}
 
-	return ret;
+	return -ENODEV;
 }
 
 
+/*
+ * Capacity as last pushed by the fuel gauge, no bus traffic. Returns
+ * -ENODATA until the gauge has reported, policy then relies on VBAT.
+ */
 static int bq2589x_read_batt_rsoc(struct bq2589x *bq)
 {
-	union power_supply_propval ret = {0,};
+	if (!bq->batt_valid)
+		return -ENODATA;
 
-	if (!bq->batt_psy) 
-		bq->batt_psy = power_supply_get_by_name("battery");
+	return bq->batt_capacity;
+}
 
-	if (bq->batt_psy) {
-		bq->batt_psy->get_property(bq->batt_psy,POWER_SUPPLY_PROP_CAPACITY,&ret);
-		return ret.intval;
-	} else {
-		return 50;
+static void bq2589x_update_batt(struct bq2589x *bq)
+{
+	union power_supply_propval val = {0,};
+	int ret;
+
+	ret = bq->batt_psy->get_property(bq->batt_psy, POWER_SUPPLY_PROP_CAPACITY, &val);
+	if (ret)
+		return;
+	bq->batt_capacity = val.intval;
+
+	ret = bq->batt_psy->get_property(bq->batt_psy, POWER_SUPPLY_PROP_VOLTAGE_NOW, &val);
+	if (!ret)
+		bq->batt_volt = val.intval / 1000;
+
+	ret = bq->batt_psy->get_property(bq->batt_psy, POWER_SUPPLY_PROP_TEMP, &val);
+	bq->batt_temp_valid = !ret;
+	if (!ret)
+		bq->batt_temp = val.intval;
+
+	bq->batt_valid = true;
+}
+
+/* bring up timestamps, on the simulation's clock under KUnit */
+static ktime_t bq2589x_now(void)
+{
+#if IS_ENABLED(CONFIG_BQ2589X_DUAL_KUNIT_TEST)
+	return ktime_add_ms(ktime_get(), READ_ONCE(bq2589x_test_skew_ms));
+#else
+	return ktime_get();
+#endif
+}
+
+static void bq2589x_bringup_start(ktime_t t_plug)
+{
+	int i;
+
+	mutex_lock(&bq2589x_bringup_lock);
+	bringup.active = true;
+	bringup.t_plug = t_plug;
+	bringup.xfer_base = bq2589x_total_xfers();
+	for (i = 0; i < BQ2589X_MARK_NUM; i++)
+		bringup.mark_ms[i] = -1;
+	mutex_unlock(&bq2589x_bringup_lock);
+}
+
+static void bq2589x_bringup_mark(enum bq2589x_bringup_mark mark)
+{
+	mutex_lock(&bq2589x_bringup_lock);
+	if (bringup.active && bringup.mark_ms[mark] < 0)
+		bringup.mark_ms[mark] = (int)ktime_ms_delta(bq2589x_now(), bringup.t_plug);
+	mutex_unlock(&bq2589x_bringup_lock);
+}
+
+/* bring up chain finished, file the session under its adapter class */
+static void bq2589x_bringup_finish(struct bq2589x *bq)
+{
+	struct bq2589x_bringup_hist *hist;
+	int cls;
+	int slot;
+	int i;
+
+	mutex_lock(&bq2589x_bringup_lock);
+	if (!bringup.active)
+		goto out;
+
+	if (bq->vbus_type == BQ2589X_VBUS_USB_DCP && pe.tune_up_volt && pe.tune_done)
+		cls = BQ2589X_BRINGUP_CLASS_PE;
+	else
+		cls = bq->vbus_type;
+
+	hist = &bringup.hist[cls];
+	slot = hist->head;
+	for (i = 0; i < BQ2589X_MARK_NUM; i++)
+		hist->mark_ms[slot][i] = bringup.mark_ms[i];
+	hist->e2e_ms[slot] = (int)ktime_ms_delta(bq2589x_now(), bringup.t_plug);
+	hist->xfers[slot] = bq2589x_total_xfers() - bringup.xfer_base;
+	hist->head = (slot + 1) % BQ2589X_BRINGUP_HISTORY;
+	if (hist->count < BQ2589X_BRINGUP_HISTORY)
+		hist->count++;
+
+	dev_info(bq->dev, "%s:%s bring up took %dms, %d i2c transactions\n", __func__,
+		bq2589x_class_name[cls], hist->e2e_ms[slot], hist->xfers[slot]);
+
+	bringup.active = false;
+out:
+	mutex_unlock(&bq2589x_bringup_lock);
+}
+
+static void bq2589x_bringup_abort(void)
+{
+	mutex_lock(&bq2589x_bringup_lock);
+	bringup.active = false;
+	mutex_unlock(&bq2589x_bringup_lock);
+}
+
+static void bq2589x_acct_reset(void)
+{
+	mutex_lock(&bq2589x_acct_lock);
+	memset(&acct, 0, sizeof(acct));
+	mutex_unlock(&bq2589x_acct_lock);
+}
+
+/*
+ * Integrate battery side power of both chargers over the interval since
+ * the previous sample, charging the whole interval to the current phase.
+ * Negative currents are ADC read failures and count as zero.
+ */
+static void bq2589x_acct_update(int phase, int vbat1, int ichg1, int vbat2, int ichg2)
+{
+	ktime_t now = ktime_get();
+	s64 dt;
+	int mw;
+
+	ichg1 = max(ichg1, 0);
+	ichg2 = max(ichg2, 0);
+	mw = (vbat1 * ichg1 + vbat2 * ichg2) / 1000;
+
+	mutex_lock(&bq2589x_acct_lock);
+	if (acct.last) {
+		dt = ktime_ms_delta(now, acct.last);
+		acct.charge[0] += (u64)ichg1 * dt;
+		acct.charge[1] += (u64)ichg2 * dt;
+		acct.energy[0] += (u64)vbat1 * ichg1 * dt;
+		acct.energy[1] += (u64)vbat2 * ichg2 * dt;
+		acct.phase_ms[phase] += dt;
+		acct.total_ms += dt;
 	}
+	acct.last = now;
+	if (mw > acct.peak_mw)
+		acct.peak_mw = mw;
+	mutex_unlock(&bq2589x_acct_lock);
 }
 
+static int bq2589x_vindpm_for_vbus(int vbus_volt)
+{
+	if (vbus_volt < 6000)
+		return vbus_volt - 600;
+	else
+		return vbus_volt - 1200;
+}
 
-static void bq2589x_adjust_absolute_vindpm(struct bq2589x *bq)
+static void bq2589x_adjust_absolute_vindpm(struct bq2589x *bq, int vbus_volt)
 {
-	u16 vbus_volt;
 	u16 vindpm_volt;
 	int ret;
 
-	msleep(1000);
-	vbus_volt = bq2589x_adc_read_vbus_volt(bq);
-	if (vbus_volt < 6000)
-		vindpm_volt = vbus_volt - 600;
-	else
-		vindpm_volt = vbus_volt - 1200;
+	if (!bq)	/* charger 2 not probed yet */
+		return;
+
+	vindpm_volt = bq2589x_vindpm_for_vbus(vbus_volt);
 
 	ret = bq2589x_set_input_volt_limit(bq, vindpm_volt);
 	if (ret < 0)
@@ -1135,259 +2714,1464 @@ static void bq2589x_adjust_absolute_vindpm(struct bq2589x *bq)
 
 }
 
-static void bq2589x_adapter_in_workfunc(struct work_struct *work)
+static void bq2589x_dpm_reset(void)
 {
-	struct bq2589x *bq = container_of(work, struct bq2589x, adapter_in_work);
-	int ret;
+	dpm.vbus_ref = 0;
+	dpm.vdpm_cycles = 0;
+	dpm.ceiling[0] = 0;
+	dpm.ceiling[1] = 0;
+}
 
-	ret = bq2589x_enter_hiz_mode(g_bq2);
-	if (ret < 0) {
-		dev_err(bq->dev, "%s: Charger 2 enter hiz mode failed\n", __func__);
-	} else {
-		dev_info(bq->dev, "%s:Charger 2 enter Hiz mode successfully\n", __func__);
-		g_bq2->enabled = false;
+/* fills *e with a copy of the matching entry, returns its slot or -1 */
+static int bq2589x_cache_lookup(int vbus_type, int idle_vbus, struct bq2589x_adapter_entry *e)
+{
+	int slot = -1;
+	int i;
+
+	mutex_lock(&bq2589x_cache_lock);
+	for (i = 0; i < BQ2589X_ADAPTER_CACHE_SIZE; i++) {
+		if (!acache.entry[i].valid || acache.entry[i].vbus_type != vbus_type
+		    || abs(acache.entry[i].idle_vbus - idle_vbus) > BQ2589X_ADAPTER_VBUS_TOL)
+			continue;
+		slot = i;
+		acache.entry[i].last_used = ++acache.seq;
+		*e = acache.entry[i];
+		break;
 	}
+	mutex_unlock(&bq2589x_cache_lock);
 
-	if (bq->vbus_type == BQ2589X_VBUS_MAXC) {
-		dev_info(bq->dev, "%s:HVDCP or Maxcharge adapter plugged in\n", __func__);
-		schedule_delayed_work(&bq->ico_work, 0);
-	} else if (bq->vbus_type == BQ2589X_VBUS_USB_DCP) {/* DCP, let's check if it is PE adapter*/
-		dev_info(bq->dev, "%s:usb dcp adapter plugged in\n", __func__);
-		schedule_delayed_work(&bq->check_pe_tuneup_work, 0);
-	} else {
-		dev_info(bq->dev, "%s:other adapter plugged in,vbus_type is %d\n", __func__, bq->vbus_type);
-		schedule_delayed_work(&bq->ico_work, 0);
-	}
+	return slot;
+}
 
-	if (bq->cfg.enable_absolute_vindpm) {
-		bq2589x_adjust_absolute_vindpm(bq);
-		bq2589x_adjust_absolute_vindpm(g_bq2);
+/* refresh the matching entry or evict the least recently used one */
+static void bq2589x_cache_learn(int slot, int vbus_type, int idle_vbus, int pe_volt, int ico_ma)
+{
+	struct bq2589x_adapter_entry *e;
+	int i;
+
+	mutex_lock(&bq2589x_cache_lock);
+	if (slot < 0 || !acache.entry[slot].valid) {
+		slot = 0;
+		for (i = 0; i < BQ2589X_ADAPTER_CACHE_SIZE; i++) {
+			if (!acache.entry[i].valid) {
+				slot = i;
+				break;
+			}
+			if (acache.entry[i].last_used < acache.entry[slot].last_used)
+				slot = i;
+		}
+		memset(&acache.entry[slot], 0, sizeof(acache.entry[slot]));
 	}
 
-	schedule_delayed_work(&bq->monitor_work, 0);
+	e = &acache.entry[slot];
+	e->valid = true;
+	e->vbus_type = vbus_type;
+	e->idle_vbus = idle_vbus;
+	e->pe_volt = pe_volt;
+	e->ico_ma = ico_ma;
+	e->last_used = ++acache.seq;
+	mutex_unlock(&bq2589x_cache_lock);
 }
 
-static void bq2589x_adapter_out_workfunc(struct work_struct *work)
+static void bq2589x_cache_evict(int slot)
 {
-	struct bq2589x *bq = container_of(work, struct bq2589x, adapter_out_work);
+	mutex_lock(&bq2589x_cache_lock);
+	acache.entry[slot].valid = false;
+	mutex_unlock(&bq2589x_cache_lock);
+}
 
-	bq2589x_set_input_volt_limit(g_bq1, 4400);
-	bq2589x_set_input_volt_limit(g_bq2, 4400);
-	
-	cancel_delayed_work_sync(&bq->monitor_work);
+static void bq2589x_cache_hit(int slot)
+{
+	mutex_lock(&bq2589x_cache_lock);
+	acache.entry[slot].hits++;
+	mutex_unlock(&bq2589x_cache_lock);
+}
+
+static void bq2589x_sm_post(struct bq2589x *bq, unsigned long event)
+{
+	unsigned long flags;
 
+	spin_lock_irqsave(&bq2589x_sm_lock, flags);
+	sm.events |= event;
+	spin_unlock_irqrestore(&bq2589x_sm_lock, flags);
+
+	mod_delayed_work(system_wq, &bq->sm_work, 0);
 }
 
-static void bq2589x_ico_workfunc(struct work_struct *work)
+static void bq2589x_sm_clear(unsigned long event)
 {
-	struct bq2589x *bq = container_of(work, struct bq2589x, ico_work.work);
-	int ret;
-	u8 status;
-	int curr;
-	static bool ico_issued;
+	unsigned long flags;
 
-	if (!ico_issued) {
-		/* Read VINDPM/IINDPM status */
-		ret = bq2589x_read_byte(bq, &status, BQ2589X_REG_13);
-		if (ret < 0) {
-			schedule_delayed_work(&bq->ico_work, 2 * HZ);
-			return;
-		}
+	spin_lock_irqsave(&bq2589x_sm_lock, flags);
+	sm.events &= ~event;
+	spin_unlock_irqrestore(&bq2589x_sm_lock, flags);
+}
 
-		ret = bq2589x_force_ico(bq);
-		if (ret < 0) {
-			schedule_delayed_work(&bq->ico_work, HZ); /* retry 1 second later*/
-			dev_info(bq->dev, "%s:ICO command issued failed:%d\n", __func__, ret);
-		} else {
-			ico_issued = true;
-			schedule_delayed_work(&bq->ico_work, 3 * HZ);
-			dev_info(bq->dev, "%s:ICO command issued successfully\n", __func__);
-		}
-	} else {
-		ico_issued = false;
-		ret = bq2589x_check_force_ico_done(bq);
-//		if (ret) {/*ico done*/
-//			dev_info(bq->dev, "%s:ICO done!\n", __func__);
-			ret = bq2589x_read_byte(bq, &status, BQ2589X_REG_13);
-			if (ret == 0) {
-				curr = (status & BQ2589X_IDPM_LIM_MASK) * BQ2589X_IDPM_LIM_LSB + BQ2589X_IDPM_LIM_BASE;
-				curr /= 2;
-				ret = bq2589x_set_input_current_limit(g_bq2, curr);
-				if (ret < 0)
-					dev_info(bq->dev, "%s:Set IINDPM for charger 2:%d,failed with code:%d\n", __func__, curr, ret);
-				else
-					dev_info(bq->dev, "%s:Set IINDPM for charger 2:%d successfully\n", __func__, curr);
+/* arm a PE+ tune, the caller moves the state machine to PE_TUNE */
+static void bq2589x_pe_start_tune(bool up, int target)
+{
+	pe.target_volt = target;
+	pe.tune_up_volt = up;
+	pe.tune_down_volt = !up;
+	pe.tune_done = false;
+	pe.tune_count = 0;
+	pe.tune_fail = false;
+}
 
-			}
-//		}
-		schedule_delayed_work(&bq->charger2_enable_work, 0);
-	}
+/* drop back from 12v to the 9v step, no further 12v attempt this session */
+static void bq2589x_pe_rollback_12v(struct bq2589x *bq)
+{
+	dev_info(bq->dev, "%s:vbus sagged at 12v, rolling back to 9v\n", __func__);
+	pe.rollback_12v = true;
+	bq2589x_pe_start_tune(false, pe.high_volt_12v_level - 1000);
 }
 
-static void bq2589x_charger2_enable_workfunc(struct work_struct *work)
+/*
+ * Charger loss model, P = sw + R * I^2. A second buck pays the fixed
+ * term again but halves the I^2 term, so dual charging only delivers
+ * more to the battery above a crossover current. Without a model in DT
+ * both chargers are always used and split evenly, as before.
+ */
+static int bq2589x_eff_loss(struct bq2589x *bq, int ma)
 {
-	struct bq2589x *bq = container_of(work, struct bq2589x, charger2_enable_work.work);
-	int ret;
+	return bq->cfg.eff_sw_loss + (int)div_u64((u64)bq->cfg.eff_res * ma * ma, 1000000);
+}
 
-	bq->rsoc = bq2589x_read_batt_rsoc(bq); 
-	if ((bq->vbus_type == BQ2589X_VBUS_MAXC 
-		|| (bq->vbus_type == BQ2589X_VBUS_USB_DCP && pe.enable && pe.tune_up_volt && pe.tune_done)) 
-		&& bq->rsoc < 95) {
-		ret = bq2589x_exit_hiz_mode(g_bq2);
-		if (ret) {
-			dev_err(bq->dev, "%s: charger 2 exit hiz mode failed:%d\n", __func__, ret);
-		} else {
-			dev_info(bq->dev, "%s: charger 2 exit hiz mode successfully\n", __func__);
-			g_bq2->enabled = true;
+static bool bq2589x_eff_prefer_dual(struct bq2589x *bq1, struct bq2589x *bq2, int ma)
+{
+	int ma2;
+
+	if (!bq1 || !bq2)
+		return false;
+
+	if (!bq1->cfg.eff_sw_loss && !bq1->cfg.eff_res)
+		return true;
+
+	/* more than charger 1 alone is allowed to deliver */
+	if (ma > bq1->cfg.charge_current)
+		return true;
+
+	ma2 = ma * bq2589x_eff_share(bq1, bq2) / 1000;
+
+	return bq2589x_eff_loss(bq1, ma) > bq2589x_eff_loss(bq1, ma - ma2) + bq2589x_eff_loss(bq2, ma2);
+}
+
+/*
+ * Battery temperature in 0.1C: TS through the NTC table when the board
+ * describes one, the gauge otherwise. Below freezing any value is valid,
+ * so it comes back through temp and the return is only ever an error.
+ */
+static int bq2589x_batt_temp(struct bq2589x *bq, int *temp)
+{
+	int mpct;
+
+	if (ntc.num) {
+		mpct = bq2589x_adc_ewma(bq, BQ2589X_CH_TSPCT);
+		if (mpct >= 0) {
+			*temp = bq2589x_ntc_temp(mpct);
+			return 0;
 		}
 	}
+
+	if (!bq->batt_temp_valid)
+		return -ENODATA;
+
+	*temp = bq->batt_temp;
+	return 0;
 }
 
+static int bq2589x_jeita_select(int temp)
+{
+	const struct bq2589x_jeita_zone *z;
+	int i;
+
+	if (jeita.zone >= 0) {
+		z = &jeita.zones[jeita.zone];
+		if (temp >= z->temp_min - jeita.hyst && temp < z->temp_max + jeita.hyst)
+			return jeita.zone;
+	}
+
+	for (i = 0; i < jeita.num; i++) {
+		z = &jeita.zones[i];
+		if (temp >= z->temp_min && temp < z->temp_max)
+			return i;
+	}
+
+	return -1;
+}
 
-static void bq2589x_check_pe_tuneup_workfunc(struct work_struct *work)
+/*
+ * Step the chargers down ahead of the chip's own TS cutoff. A zone
+ * change re-programs both chargers from what policy last requested.
+ */
+static void bq2589x_jeita_update(struct bq2589x *bq)
 {
-	struct bq2589x *bq = container_of(work, struct bq2589x, check_pe_tuneup_work.work);
+	struct bq2589x *chg[] = { g_bq1, g_bq2 };
+	int ichg_pm = 1000;
+	int vreg_drop = 0;
+	bool known;
+	int zone = -1;
+	int temp = 0;
+	int i;
+
+	if (!jeita.num)
+		return;
 
-	if (!pe.enable) {
-		schedule_delayed_work(&bq->ico_work, 0);
+	known = !bq2589x_batt_temp(bq, &temp);
+	if (known) {
+		zone = bq2589x_jeita_select(temp);
+		ichg_pm = zone < 0 ? 0 : jeita.zones[zone].ichg_pm;
+		vreg_drop = zone < 0 ? 0 : jeita.zones[zone].vreg_drop;
+	}
+
+	if (ichg_pm == jeita.ichg_pm && vreg_drop == jeita.vreg_drop) {
+		jeita.zone = zone;
 		return;
 	}
 
-	g_bq1->vbat_volt = bq2589x_adc_read_battery_volt(g_bq1);
-	g_bq1->rsoc = bq2589x_read_batt_rsoc(g_bq1); 
+	if (zone < 0 && known)
+		dev_warn(bq->dev, "%s:battery temp %d (0.1C) outside every zone, charging suspended\n",
+			__func__, temp);
+	else
+		dev_info(bq->dev, "%s:battery temp %d (0.1C), zone %d: ichg %d%%, vreg -%dmV\n",
+			__func__, temp, zone, ichg_pm / 10, vreg_drop);
+
+	jeita.zone = zone;
+	jeita.ichg_pm = ichg_pm;
+	jeita.vreg_drop = vreg_drop;
+	ir.expect = true;
+
+	for (i = 0; i < ARRAY_SIZE(chg); i++) {
+		if (!chg[i])
+			continue;
+		bq2589x_request_vreg(chg[i], chg[i]->vreg_req);
+		bq2589x_request_ichg(chg[i], chg[i]->ichg_req);
+	}
+	bq2589x_changed(BQ2589X_CHANGED_PSY);
+}
+
+/*
+ * Property writes only record the ceiling and kick this. Both chargers
+ * are re-requested into the shadow and only the registers that changed
+ * go out, so a burst of writes costs one register update per charger.
+ */
+static void bq2589x_limits_apply(void)
+{
+	struct bq2589x *chg[] = { g_bq1, g_bq2 };
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(chg); i++) {
+		if (!chg[i] || !chg[i]->shadow_loaded)
+			continue;
+		bq2589x_stage_begin(chg[i]);
+		bq2589x_request_vreg(chg[i], chg[i]->vreg_req);
+		bq2589x_request_ichg(chg[i], chg[i]->ichg_req);
+		bq2589x_request_iinlim(chg[i], chg[i]->iinlim_req);
+		bq2589x_stage_end(chg[i], true);
+	}
+	ir.expect = true;
+	bq2589x_changed(BQ2589X_CHANGED_PSY);
+}
+
+static void bq2589x_limits_workfunc(struct work_struct *work)
+{
+	mutex_lock(&bq2589x_role_lock);
+	bq2589x_limits_apply();
+	mutex_unlock(&bq2589x_role_lock);
+}
+
+/* the pair ceilings split by which chargers run, redo them when that changes */
+static void bq2589x_limits_resplit(void)
+{
+	struct limits_ctrl l = bq2589x_ulim_get();
+
+	if (l.ichg >= 0 || l.iinlim >= 0)
+		bq2589x_limits_apply();
+}
+
+/*
+ * The input limits of the running chargers never add up to more than
+ * the source contract or the userspace ceiling. Fails when a ceiling
+ * is too small to split, each charger takes at least IINLIM_BASE.
+ */
+static bool bq2589x_pair_iinlim_ok(void)
+{
+	struct limits_ctrl l = bq2589x_ulim_get();
+	int cap = READ_ONCE(g_bq1->src_curr);
+	int sum;
+
+	if (l.iinlim >= 0)
+		cap = cap > 0 ? min(cap, l.iinlim) : l.iinlim;
+	if (cap <= 0)
+		return true;
+
+	sum = BQ2589X_DECODE(g_bq1->shadow[BQ2589X_REG_00], IINLIM);
+	if (g_bq2 && g_bq2->enabled)
+		sum += BQ2589X_DECODE(g_bq2->shadow[BQ2589X_REG_00], IINLIM);
+
+	return sum <= cap;
+}
+
+static void bq2589x_step_reset(void)
+{
+	step.valid = false;
+	step.stage = 0;
+	step.total = 0;
+	step.vreg = 0;
+	step.ichg1 = 0;
+	step.vreg1 = 0;
+}
+
+/* VREG policy decisions work against, the stage's while step charging */
+static int bq2589x_vreg(struct bq2589x *bq)
+{
+	struct limits_ctrl l = bq2589x_ulim_get();
+	int vreg = (step.num && step.vreg) ? step.vreg : bq->cfg.charge_voltage;
+
+	return l.vreg >= 0 ? min(vreg, l.vreg) : vreg;
+}
+
+static int bq2589x_step_select(struct bq2589x *bq, int vbat)
+{
+	const struct bq2589x_step_row *r;
+	bool known;
+	int temp = 0;
+	int bound;
+	int i;
+
+	known = !bq2589x_batt_temp(bq, &temp);
+
+	for (i = 0; i < step.num; i++) {
+		r = &step.rows[i];
+		bound = r->vbat_max;
+		/* back to an earlier, stronger row only once VBAT has clearly dropped */
+		if (bound && i < step.stage)
+			bound -= step.hyst;
+		if (bound && vbat >= bound)
+			continue;
+		/* without a temperature the bands can't be told apart, match on VBAT */
+		if (known && (temp < r->temp_min || temp >= r->temp_max))
+			continue;
+		return i;
+	}
+
+	return -1;
+}
+
+/* a charger's part of the stage total never exceeds its own charge-current */
+static int bq2589x_step_ichg1(int ichg2)
+{
+	return min(step.total - ichg2, g_bq1->cfg.charge_current);
+}
+
+static int bq2589x_step_ichg2(void)
+{
+	struct bq2589x *bq2 = READ_ONCE(g_bq2);
+
+	if (!bq2)
+		return 0;
+
+	return min(step.total * bq2589x_eff_share(g_bq1, bq2) / 1000, bq2->cfg.charge_current);
+}
+
+/*
+ * Program the stage: charger 2 takes its efficiency share of the total
+ * (less while tapering out), charger 1 the rest, each within its rating.
+ * Only what changed is written.
+ */
+static void bq2589x_step_apply(struct bq2589x *bq)
+{
+	int ichg1;
+	int ichg2 = 0;
+
+	if (step.vreg && step.vreg != step.vreg1) {
+		step.vreg1 = step.vreg;
+		bq2589x_request_vreg(g_bq1, step.vreg);
+		if (g_bq2)
+			bq2589x_request_vreg(g_bq2, step.vreg);
+	}
+
+	if (g_bq2 && g_bq2->enabled) {
+		ichg2 = bq2589x_step_ichg2();
+		if (chg2.tapering)
+			ichg2 = min(ichg2, chg2.ichg);
+		if (ichg2 != chg2.ichg) {
+			chg2.ichg = ichg2;
+			bq2589x_request_ichg(g_bq2, ichg2);
+		}
+	}
+
+	ichg1 = bq2589x_step_ichg1(ichg2);
+	if (ichg1 != step.ichg1) {
+		step.ichg1 = ichg1;
+		bq2589x_request_ichg(g_bq1, step.ichg1);
+		ir.expect = true;
+	}
+}
+
+/* evaluated on every monitor sample */
+static void bq2589x_step_update(struct bq2589x *bq, int vbat)
+{
+	const struct bq2589x_step_row *r;
+	bool known;
+	int temp = 0;
+	int stage;
+
+	if (!step.num)
+		return;
+
+	known = !bq2589x_batt_temp(bq, &temp);
+	stage = bq2589x_step_select(bq, vbat);
+	if (stage != step.stage || !step.valid) {
+		if (stage < 0) {
+			dev_warn(bq->dev, "%s:no step for vbat %dmV temp %d, charging suspended\n",
+				__func__, vbat, temp);
+			step.total = 0;
+			step.vreg = 0;
+		} else {
+			r = &step.rows[stage];
+			step.total = r->ichg;
+			if (!known)	/* band unknown, stay at the single setpoint */
+				step.total = min(step.total, bq->cfg.charge_current);
+			step.vreg = min(r->vreg, bq->cfg.charge_voltage);
+			dev_info(bq->dev, "%s:vbat %dmV, step %d: ichg %dmA vreg %dmV\n",
+				__func__, vbat, stage, step.total, step.vreg);
+		}
+		step.stage = stage;
+		step.valid = true;
+	}
+
+	bq2589x_step_apply(bq);
+}
+
+/*
+ * Entry side of the hysteresis band, evaluated only when bringing charger
+ * 2 up. in_ma/vbus is the input the source can supply, 0 if unknown.
+ */
+static bool bq2589x_charger2_may_engage(struct bq2589x *bq, int in_ma, int vbus)
+{
+	int demand;
+	int vbat;
+
+	if (!g_bq2)
+		return false;
+
+	bq->rsoc = bq2589x_read_batt_rsoc(bq);
+	if (bq->rsoc >= chg2.exit_soc - chg2.soc_hyst)
+		return false;
+
+	vbat = bq2589x_adc_read_battery_volt(bq);
+	if (vbat < 0 || vbat >= bq2589x_vreg(bq) - chg2.vbat_hyst)
+		return false;
+
+	if (in_ma <= 0 || vbus <= 0 || !vbat)
+		return true;
+
+	/* battery current the source can sustain, at a nominal 90% */
+	demand = vbus * in_ma / vbat * 9 / 10;
+	if (!bq2589x_eff_prefer_dual(g_bq1, g_bq2, demand)) {
+		dev_info(bq->dev, "%s:%dmA is below the dual charger crossover, single charger\n",
+			__func__, demand);
+		return false;
+	}
+
+	return true;
+}
+
+static int bq2589x_charger2_engage(struct bq2589x *bq)
+{
+	int ret;
+
+	/* charger 2 only runs on limits this driver programmed */
+	if (!g_bq2->shadow_loaded) {
+		dev_err(bq->dev, "%s: charger 2 was never configured, keeping it parked\n", __func__);
+		return -ENODEV;
+	}
+
+	chg2.tapering = false;
+	if (step.num && step.total) {
+		/* hand charger 2 its share, charger 1 gives it up first */
+		chg2.ichg = bq2589x_step_ichg2();
+		step.ichg1 = bq2589x_step_ichg1(chg2.ichg);
+		bq2589x_request_ichg(g_bq1, step.ichg1);
+	} else {
+		chg2.ichg = g_bq2->cfg.charge_current;
+	}
+	bq2589x_request_ichg(g_bq2, chg2.ichg);
+
+	/* split the input limits for two before charger 2 can draw anything */
+	g_bq2->enabled = true;
+	bq2589x_limits_resplit();
+	if (!bq2589x_pair_iinlim_ok()) {
+		dev_err(bq->dev, "%s: input limits exceed what the pair may draw, keeping charger 2 parked\n",
+			__func__);
+		ret = -ERANGE;
+		goto park;
+	}
+
+	ret = bq2589x_exit_hiz_mode(g_bq2);
+	if (ret) {
+		dev_err(bq->dev, "%s: charger 2 exit hiz mode failed:%d\n", __func__, ret);
+		goto park;
+	}
+
+	dev_info(bq->dev, "%s: charger 2 exit hiz mode successfully\n", __func__);
+	ir.expect = true;
+	bq2589x_changed(BQ2589X_CHANGED_SM);
+	bq2589x_bringup_mark(BQ2589X_MARK_CHG2_ENABLE);
+
+	return 0;
+
+park:
+	g_bq2->enabled = false;
+	bq2589x_limits_resplit();
+	return ret;
+}
+
+/*
+ * Exit side: once in CV, near full or the combined current no longer
+ * needs two chargers, walk charger 2's ICHG down a step per monitor
+ * cycle and only then park it in HiZ, so the handoff to charger 1 is
+ * gradual. The PE+ tune down follows charger 2 leaving, once.
+ */
+static void bq2589x_charger2_taper(struct bq2589x *bq, int vbat, int ichg_total)
+{
+	bool cv;
+	int ret;
+
+	cv = vbat >= bq2589x_vreg(bq) - chg2.cv_margin;
+	/* the 10% margin keeps exit apart from the engage decision */
+	if (!chg2.tapering && !cv && bq->rsoc < chg2.exit_soc
+	    && (ichg_total < 0 || (ichg_total >= chg2.exit_current
+				   && bq2589x_eff_prefer_dual(g_bq1, g_bq2, ichg_total + ichg_total / 10))))
+		return;
+
+	chg2.tapering = true;
+	chg2.ichg -= chg2.taper_step;
+	if (chg2.ichg >= chg2.taper_min) {
+		dev_info(bq->dev, "%s: charger 2 tapering to %dmA\n", __func__, chg2.ichg);
+		bq2589x_request_ichg(g_bq2, chg2.ichg);
+		ir.expect = true;
+		return;
+	}
+
+	ret = bq2589x_enter_hiz_mode(g_bq2);
+	if (ret) {
+		dev_err(g_bq1->dev, "%s: charger 2 enter hiz mode failed:%d\n", __func__, ret);
+		chg2.ichg += chg2.taper_step;
+		return;
+	}
+
+	dev_info(g_bq1->dev, "%s: charger 2 enter hiz mode successfully\n", __func__);
+	g_bq2->enabled = false;
+	ir.expect = true;
+	bq2589x_limits_resplit();
+	chg2.tapering = false;
+	bq2589x_changed(BQ2589X_CHANGED_SM);
+
+	bq2589x_sm_post(bq, BQ2589X_EV_PE_TUNE_DOWN);
+}
+
+/*
+ * The port controller already negotiated the contract, go straight to
+ * the input limits and charger split it allows: no DPDM, PE+ or ICO.
+ */
+static void bq2589x_apply_source_cap(struct bq2589x *bq)
+{
+	int volt = READ_ONCE(bq->src_volt);
+	int src_curr = READ_ONCE(bq->src_curr);
+	bool dual;
+	int curr2 = 0;
+	int curr;
+
+	/* withdrawn meanwhile, the event that follows restores the defaults */
+	if (volt <= 0 || src_curr <= 0)
+		return;
+
+	dual = volt > 6000 && bq2589x_charger2_may_engage(bq, src_curr, volt);
+	if (dual)
+		curr2 = src_curr * bq2589x_eff_share(g_bq1, g_bq2) / 1000;
+	curr = src_curr - curr2;
+
+	dev_info(bq->dev, "%s:source contract %dmV/%dmA, %s charger\n", __func__,
+		volt, src_curr, dual ? "dual" : "single");
+
+	/* with relative VINDPM the chip tracks VBUS itself and ignores the field */
+	if (bq->cfg.enable_absolute_vindpm) {
+		bq2589x_set_input_volt_limit(g_bq1, bq2589x_vindpm_for_vbus(volt));
+		if (g_bq2)
+			bq2589x_set_input_volt_limit(g_bq2, bq2589x_vindpm_for_vbus(volt));
+	}
+	bq2589x_request_iinlim(g_bq1, curr);
+
+	if (dual) {
+		bq2589x_request_iinlim(g_bq2, curr2);
+		bq2589x_charger2_engage(bq);
+	}
+
+	bq2589x_bringup_finish(bq);
+}
+
+/*
+ * The contract went away with VBUS still present: undo what
+ * bq2589x_apply_source_cap() set up before detection runs again, ICO
+ * in particular would otherwise stop at the contract's IINLIM.
+ */
+static void bq2589x_drop_source_cap(struct bq2589x *bq)
+{
+	dev_info(bq->dev, "%s:source contract withdrawn\n", __func__);
+
+	if (bq->cfg.enable_absolute_vindpm) {
+		bq2589x_set_input_volt_limit(g_bq1, 4400);
+		if (g_bq2)
+			bq2589x_set_input_volt_limit(g_bq2, 4400);
+	}
+	/* nothing says what is left at the port, fall back to the board's limit */
+	bq2589x_request_iinlim(g_bq1, g_bq1->cfg.input_current_limit);
+}
+
+/* a PE+ tune up only pays off on a battery that can take the power and isn't nearly full */
+static bool bq2589x_pe_eligible(int vbat, int rsoc)
+{
+	return vbat > pe.vbat_min_volt && rsoc < chg2.exit_soc;
+}
+
+static int bq2589x_sm_adapter_in(struct bq2589x *bq, unsigned int *delay_ms)
+{
+	int next;
+	int ret;
+
+	bq2589x_bringup_mark(BQ2589X_MARK_ADAPTER_IN);
+	bq2589x_adc_filter_reset(g_bq1, BQ2589X_ADC_ALL);
+	bq2589x_adc_filter_reset(g_bq2, BQ2589X_ADC_ALL);
+
+	if (g_bq2) {
+		ret = bq2589x_enter_hiz_mode(g_bq2);
+		if (ret < 0) {
+			dev_err(bq->dev, "%s: Charger 2 enter hiz mode failed\n", __func__);
+		} else {
+			dev_info(bq->dev, "%s:Charger 2 enter Hiz mode successfully\n", __func__);
+			g_bq2->enabled = false;
+		}
+	}
+
+	bq2589x_watchdog_arm(bq, true);
+	schedule_delayed_work(&bq->monitor_work, 0);
+
+	if (READ_ONCE(bq->src_volt) > 0) {
+		bq2589x_apply_source_cap(bq);
+		return BQ2589X_SM_CHARGING;
+	}
+
+	sm.idle_vbus = bq2589x_adc_read_vbus_volt(bq);
+	if (sm.idle_vbus > 0)
+		sm.cache_hit = bq2589x_cache_lookup(bq->vbus_type, sm.idle_vbus, &sm.cached);
+
+	if (sm.cache_hit >= 0) {
+		dev_info(bq->dev, "%s:known adapter, pe volt %d, ico %dmA\n", __func__,
+			sm.cached.pe_volt, sm.cached.ico_ma);
+		if (sm.cached.pe_volt && pe.enable) {
+			g_bq1->vbat_volt = bq2589x_adc_read_battery_volt(g_bq1);
+			g_bq1->rsoc = bq2589x_read_batt_rsoc(g_bq1);
+			if (!bq2589x_pe_eligible(g_bq1->vbat_volt, g_bq1->rsoc)) {
+				/* stay at 5v, without the PE+ voltage VERIFY must not expect it */
+				dev_info(bq->dev, "%s:vbat %dmV soc %d, not raising vbus\n", __func__,
+					g_bq1->vbat_volt, g_bq1->rsoc);
+				sm.pe_skipped = true;
+				sm.cached.pe_volt = 0;
+			}
+		}
+		if (sm.cached.pe_volt && pe.enable) {
+			pe.at_12v = false;
+			/* a 9v entry means 12v was refused or rolled back, don't ask again */
+			pe.rollback_12v = sm.cached.pe_volt == pe.high_volt_level;
+			bq2589x_pe_start_tune(true, sm.cached.pe_volt);
+			next = BQ2589X_SM_PE_TUNE;
+		} else {
+			next = BQ2589X_SM_CACHE_APPLY;
+		}
+	} else if (bq->vbus_type == BQ2589X_VBUS_MAXC) {
+		dev_info(bq->dev, "%s:HVDCP or Maxcharge adapter plugged in\n", __func__);
+		next = BQ2589X_SM_ICO;
+	} else if (bq->vbus_type == BQ2589X_VBUS_USB_DCP) {/* DCP, let's check if it is PE adapter*/
+		dev_info(bq->dev, "%s:usb dcp adapter plugged in\n", __func__);
+		next = BQ2589X_SM_PE_CHECK;
+	} else {
+		dev_info(bq->dev, "%s:other adapter plugged in,vbus_type is %d\n", __func__, bq->vbus_type);
+		next = BQ2589X_SM_ICO;
+	}
+
+	if (!bq->cfg.enable_absolute_vindpm)
+		return next;
+
+	sm.settle_next = next;
+	*delay_ms = BQ2589X_VINDPM_SETTLE_MS;
+	return BQ2589X_SM_VINDPM_SETTLE;
+}
+
+static int bq2589x_sm_vindpm_settle(struct bq2589x *bq, unsigned int *delay_ms)
+{
+	int vbus;
 
-	if (bq->vbat_volt > pe.vbat_min_volt && g_bq1->rsoc < 95) {
+	/* both chips sit on the same VBUS, place them from one stable reading */
+	vbus = bq2589x_adc_stable(bq, BQ2589X_CH_VBUSV, delay_ms);
+	if (vbus < 0)
+		return BQ2589X_SM_VINDPM_SETTLE;
+
+	bq2589x_adjust_absolute_vindpm(bq, vbus);
+	bq2589x_adjust_absolute_vindpm(g_bq2, vbus);
+
+	return sm.settle_next;
+}
+
+static int bq2589x_sm_settle_then(int next, unsigned int *delay_ms)
+{
+	/* VBUS is on the move, samples from before don't describe it */
+	bq2589x_adc_filter_reset(g_bq1, BIT(BQ2589X_CH_VBUSV));
+	sm.settle_next = next;
+	*delay_ms = BQ2589X_VINDPM_SETTLE_MS;
+	return BQ2589X_SM_VINDPM_SETTLE;
+}
+
+static int bq2589x_sm_pe_check(struct bq2589x *bq, unsigned int *delay_ms)
+{
+	bq2589x_bringup_mark(BQ2589X_MARK_PE_CHECK);
+
+	if (!pe.enable)
+		return BQ2589X_SM_ICO;
+
+	g_bq1->vbat_volt = bq2589x_adc_read_battery_volt(g_bq1);
+	g_bq1->rsoc = bq2589x_read_batt_rsoc(g_bq1); 
+
+	if (bq->vbat_volt < 0) {
+		*delay_ms = 1000;
+		return BQ2589X_SM_PE_CHECK;
+	}
+
+	if (bq2589x_pe_eligible(bq->vbat_volt, g_bq1->rsoc)) {
 		dev_info(bq->dev, "%s:trying to tune up vbus voltage\n", __func__);
-		pe.target_volt = pe.high_volt_level;
+		sm.pe_tried = true;
+		pe.at_12v = false;
+		pe.rollback_12v = false;
+		bq2589x_pe_start_tune(true, pe.high_volt_level);
+		return BQ2589X_SM_PE_TUNE;
+	} else if (g_bq1->rsoc >= chg2.exit_soc) {
+		return BQ2589X_SM_ICO;
+	}
+
+	/* wait battery voltage up enough to check again */
+	*delay_ms = 2000;
+	return BQ2589X_SM_PE_CHECK;
+}
+
+static int bq2589x_sm_pe_tune(struct bq2589x *bq, unsigned int *delay_ms)
+{
+	int ret = -EINVAL;
+	int vbus;
+
+	vbus = bq2589x_adc_stable(g_bq1, BQ2589X_CH_VBUSV, delay_ms);
+	if (vbus < 0)
+		return BQ2589X_SM_PE_TUNE;
+	g_bq1->vbus_volt = vbus;
+
+	dev_info(bq->dev, "%s:vbus voltage:%d, Tune Target Volt:%d\n", __func__, g_bq1->vbus_volt, pe.target_volt);
+
+	if ((pe.tune_up_volt && g_bq1->vbus_volt > pe.target_volt) ||
+	    (pe.tune_down_volt && g_bq1->vbus_volt < pe.target_volt)) {
+		dev_info(bq->dev, "%s:voltage tune successfully\n", __func__);
+		pe.tune_done = true;
+		return bq2589x_sm_settle_then(BQ2589X_SM_PE_SETTLED, delay_ms);
+	}
+
+	if (pe.tune_count > 10) {
+		dev_info(bq->dev, "%s:voltage tune failed,reach max retry count\n", __func__);
+		pe.tune_fail = true;
+		return bq2589x_sm_settle_then(BQ2589X_SM_PE_FAILED, delay_ms);
+	}
+
+	if (pe.tune_up_volt)
+		ret = bq2589x_pumpx_increase_volt(bq);
+	else if (pe.tune_down_volt)
+		ret = bq2589x_pumpx_decrease_volt(bq);
+	if (ret) {
+		*delay_ms = 1000;
+		return BQ2589X_SM_PE_TUNE;
+	}
+
+	dev_info(bq->dev, "%s:pumpx command issued.\n", __func__);
+	pe.tune_count++;
+	*delay_ms = 3000;
+	return BQ2589X_SM_PE_PUMP_WAIT;
+}
+
+static int bq2589x_sm_pe_pump_wait(struct bq2589x *bq, unsigned int *delay_ms)
+{
+	int ret;
+
+	if (pe.tune_up_volt)
+		ret = bq2589x_pumpx_increase_volt_done(bq);
+	else
+		ret = bq2589x_pumpx_decrease_volt_done(bq);
+	if (ret == 0) {/*finished for one step*/
+		dev_info(bq->dev, "%s:pumpx command finishedd!\n", __func__);
+		return bq2589x_sm_settle_then(BQ2589X_SM_PE_TUNE, delay_ms);
+	}
+
+	*delay_ms = 1000;
+	return BQ2589X_SM_PE_PUMP_WAIT;
+}
+
+static int bq2589x_sm_pe_settled(struct bq2589x *bq, unsigned int *delay_ms)
+{
+	int ret;
+
+	if (pe.tune_up_volt && pe.target_volt == pe.high_volt_level
+	    && bq->cfg.enable_12v && !pe.rollback_12v) {
+		/* 9v reached, continue to the 12v step */
+		bq2589x_pe_start_tune(true, pe.high_volt_12v_level);
+		return BQ2589X_SM_PE_TUNE;
+	}
+
+	if (pe.tune_up_volt && pe.target_volt == pe.high_volt_12v_level) {
+		/* vindpm settled under load, validate before committing */
+		ret = bq2589x_adc_stable(bq, BQ2589X_CH_VBUSV, delay_ms);
+		if (ret < 0)
+			return BQ2589X_SM_PE_SETTLED;
+		if (ret < pe.high_volt_12v_level) {
+			bq2589x_pe_rollback_12v(bq);
+			return BQ2589X_SM_PE_TUNE;
+		}
+		pe.at_12v = true;
+	}
+
+	if (pe.tune_down_volt && pe.rollback_12v) {
+		/* back at 9v, resume the boosted bring up */
+		pe.at_12v = false;
 		pe.tune_up_volt = true;
 		pe.tune_down_volt = false;
-		pe.tune_done = false;
-		pe.tune_count = 0;
+		pe.target_volt = pe.high_volt_level;
+	}
+
+	if (!pe.tune_up_volt)
+		return BQ2589X_SM_CHARGING;
+
+	bq2589x_bringup_mark(BQ2589X_MARK_PE_TUNED);
+	return sm.cache_hit >= 0 ? BQ2589X_SM_CACHE_APPLY : BQ2589X_SM_ICO;
+}
+
+static int bq2589x_sm_pe_failed(struct bq2589x *bq, unsigned int *delay_ms)
+{
+	if (sm.cache_hit >= 0) {
+		/* the adapter no longer answers as it used to, learn it again */
+		bq2589x_cache_evict(sm.cache_hit);
+		sm.cache_hit = -1;
+	}
+
+	/* 12v step refused, the adapter is still at 9v */
+	if (pe.tune_up_volt && pe.target_volt == pe.high_volt_12v_level
+	    && g_bq1->vbus_volt > pe.high_volt_level) {
+		pe.target_volt = pe.high_volt_level;
+		pe.tune_done = true;
 		pe.tune_fail = false;
-		schedule_delayed_work(&bq->pe_volt_tune_work, 0);
-	} else if (g_bq1->rsoc >= 95) {
-		schedule_delayed_work(&bq->ico_work, 0);
-	} else {
-		/* wait battery voltage up enough to check again */
-		schedule_delayed_work(&bq->check_pe_tuneup_work, 2 * HZ); 
+		bq2589x_bringup_mark(BQ2589X_MARK_PE_TUNED);
+	}
+
+	return pe.tune_up_volt ? BQ2589X_SM_ICO : BQ2589X_SM_CHARGING;
+}
+
+static int bq2589x_sm_ico(struct bq2589x *bq, unsigned int *delay_ms)
+{
+	int ret;
+
+	ret = bq2589x_force_ico(bq);
+	if (ret < 0) {
+		dev_info(bq->dev, "%s:ICO command issued failed:%d\n", __func__, ret);
+		*delay_ms = 1000; /* retry 1 second later*/
+		return BQ2589X_SM_ICO;
+	}
+
+	dev_info(bq->dev, "%s:ICO command issued successfully\n", __func__);
+	bq2589x_sm_clear(BQ2589X_EV_RERUN_ICO);	/* this run covers it */
+	*delay_ms = 3000;
+	return BQ2589X_SM_ICO_WAIT;
+}
+
+static int bq2589x_sm_ico_wait(struct bq2589x *bq, unsigned int *delay_ms)
+{
+	u8 status;
+	int curr;
+	int ret;
+
+	bq2589x_bringup_mark(BQ2589X_MARK_ICO_DONE);
+	bq2589x_dpm_reset();	/* new baseline for the input power tracker */
+	ir.expect = true;
+
+	ret = bq2589x_read_byte(bq, &status, BQ2589X_REG_13);
+	sm.ico_ma = ret ? 0 : BQ2589X_DECODE(status, IDPM_LIM);
+	if (ret == 0 && g_bq2) {
+		curr = sm.ico_ma * bq2589x_eff_share(g_bq1, g_bq2) / 1000;
+		ret = bq2589x_request_iinlim(g_bq2, curr);
+		if (ret < 0)
+			dev_info(bq->dev, "%s:Set IINDPM for charger 2:%d,failed with code:%d\n", __func__, curr, ret);
+		else
+			dev_info(bq->dev, "%s:Set IINDPM for charger 2:%d successfully\n", __func__, curr);
+	}
+
+	return BQ2589X_SM_CHG2_ENABLE;
+}
+
+/* learned limits in place of ICO, checked by CACHE_VERIFY once loaded */
+static int bq2589x_sm_cache_apply(struct bq2589x *bq, unsigned int *delay_ms)
+{
+	bq2589x_request_iinlim(bq, sm.cached.ico_ma);
+	if (g_bq2)
+		bq2589x_request_iinlim(g_bq2, sm.cached.ico_ma * bq2589x_eff_share(g_bq1, g_bq2) / 1000);
+
+	sm.ico_ma = sm.cached.ico_ma;
+	bq2589x_bringup_mark(BQ2589X_MARK_ICO_DONE);
+	bq2589x_dpm_reset();
+	ir.expect = true;
+
+	*delay_ms = 2000;
+	return BQ2589X_SM_CACHE_VERIFY;
+}
+
+static int bq2589x_sm_cache_verify(struct bq2589x *bq, unsigned int *delay_ms)
+{
+	u8 status;
+	int vbus;
+	int ret;
+
+	vbus = bq2589x_adc_stable(bq, BQ2589X_CH_VBUSV, delay_ms);
+	if (vbus < 0)
+		return BQ2589X_SM_CACHE_VERIFY;
+
+	ret = bq2589x_read_byte(bq, &status, BQ2589X_REG_13);
+	if (ret) {
+		*delay_ms = 1000;
+		return BQ2589X_SM_CACHE_VERIFY;
+	}
+
+	if ((status & BQ2589X_VDPM_STAT_MASK) || (sm.cached.pe_volt && vbus < sm.cached.pe_volt)) {
+		dev_info(bq->dev, "%s:cached limits don't hold (vbus %d, status 0x%02x), running ico\n",
+			__func__, vbus, status);
+		bq2589x_cache_evict(sm.cache_hit);
+		sm.cache_hit = -1;
+		return BQ2589X_SM_ICO;
+	}
+
+	bq2589x_cache_hit(sm.cache_hit);
+	return BQ2589X_SM_CHG2_ENABLE;
+}
+
+static int bq2589x_sm_chg2_enable(struct bq2589x *bq, unsigned int *delay_ms)
+{
+	int pe_volt = (pe.tune_up_volt && pe.tune_done) ? pe.target_volt : 0;
+
+	/*
+	 * A DCP is only known once PE+ was actually tried on it. A session
+	 * held at 5v for the battery's sake says nothing about the adapter.
+	 */
+	if (sm.ico_ma && !sm.pe_skipped
+	    && (bq->vbus_type != BQ2589X_VBUS_USB_DCP || sm.pe_tried || sm.cache_hit >= 0))
+		bq2589x_cache_learn(sm.cache_hit, bq->vbus_type, sm.idle_vbus, pe_volt, sm.ico_ma);
+
+	if ((bq->vbus_type == BQ2589X_VBUS_MAXC 
+		|| (bq->vbus_type == BQ2589X_VBUS_USB_DCP && pe.enable && pe.tune_up_volt && pe.tune_done)) 
+		&& bq2589x_charger2_may_engage(bq, sm.ico_ma, bq2589x_adc_read_vbus_volt(bq)))
+		bq2589x_charger2_engage(bq);
+	else if (sm.adopted && g_bq2 && g_bq2->enabled && !bq2589x_enter_hiz_mode(g_bq2)) {
+		g_bq2->enabled = false;	/* left running by a previous instance */
+		ir.expect = true;
+		bq2589x_limits_resplit();
+		bq2589x_changed(BQ2589X_CHANGED_SM);
+	}
+	/* one we engaged ourselves leaves through the taper in the monitor */
+	sm.adopted = false;
+
+	bq2589x_bringup_finish(bq);
+
+	return BQ2589X_SM_CHARGING;
+}
+
+/*
+ * Probe found the chips still configured and VBUS up: rebuild the
+ * session from what is live instead of parking charger 2 and running
+ * detection, PE+ and ICO again.
+ */
+static int bq2589x_sm_warm_start(struct bq2589x *bq, unsigned int *delay_ms)
+{
+	u8 status;
+	int vbus;
+
+	if (READ_ONCE(bq->src_volt) > 0)
+		return BQ2589X_SM_ADAPTER_IN;
+
+	vbus = bq2589x_adc_stable(bq, BQ2589X_CH_VBUSV, delay_ms);
+	if (vbus == -EAGAIN)
+		return BQ2589X_SM_WARM_START;
+	if (vbus < 0 || bq2589x_read_byte(bq, &status, BQ2589X_REG_13))
+		return BQ2589X_SM_ADAPTER_IN;
+
+	sm.ico_ma = BQ2589X_DECODE(status, IDPM_LIM);
+
+	/* a DCP above the tune-up level can only be there through PE+ */
+	if (pe.enable && bq->vbus_type == BQ2589X_VBUS_USB_DCP && vbus > pe.high_volt_level) {
+		sm.pe_tried = true;
+		pe.tune_up_volt = true;
+		pe.tune_done = true;
+		pe.target_volt = pe.high_volt_level;
+		if (bq->cfg.enable_12v && vbus > pe.high_volt_12v_level) {
+			pe.target_volt = pe.high_volt_12v_level;
+			pe.at_12v = true;
+		}
+	}
+
+	dev_info(bq->dev, "%s:resumed at vbus %dmV, ico %dmA, charger 2 %s\n", __func__,
+		vbus, sm.ico_ma, (g_bq2 && g_bq2->enabled) ? "active" : "parked");
+
+	/* a charger 2 still running is part of the resumed session */
+	sm.adopted = false;
+
+	/* nothing was brought up, keep it out of the bring up statistics */
+	bq2589x_bringup_abort();
+	bq2589x_watchdog_arm(bq, true);
+	schedule_delayed_work(&bq->monitor_work, 0);
+
+	return BQ2589X_SM_CHARGING;
+}
+
+typedef int (*bq2589x_sm_handler)(struct bq2589x *bq, unsigned int *delay_ms);
+
+/* transition table, a NULL handler is a steady state only events leave */
+static const bq2589x_sm_handler bq2589x_sm_handlers[BQ2589X_SM_NUM] = {
+	[BQ2589X_SM_ADAPTER_IN]		= bq2589x_sm_adapter_in,
+	[BQ2589X_SM_WARM_START]		= bq2589x_sm_warm_start,
+	[BQ2589X_SM_VINDPM_SETTLE]	= bq2589x_sm_vindpm_settle,
+	[BQ2589X_SM_PE_CHECK]		= bq2589x_sm_pe_check,
+	[BQ2589X_SM_PE_TUNE]		= bq2589x_sm_pe_tune,
+	[BQ2589X_SM_PE_PUMP_WAIT]	= bq2589x_sm_pe_pump_wait,
+	[BQ2589X_SM_PE_SETTLED]		= bq2589x_sm_pe_settled,
+	[BQ2589X_SM_PE_FAILED]		= bq2589x_sm_pe_failed,
+	[BQ2589X_SM_ICO]			= bq2589x_sm_ico,
+	[BQ2589X_SM_ICO_WAIT]		= bq2589x_sm_ico_wait,
+	[BQ2589X_SM_CACHE_APPLY]	= bq2589x_sm_cache_apply,
+	[BQ2589X_SM_CACHE_VERIFY]	= bq2589x_sm_cache_verify,
+	[BQ2589X_SM_CHG2_ENABLE]	= bq2589x_sm_chg2_enable,
+};
+
+static void bq2589x_sm_enter(int state, unsigned int delay_ms)
+{
+	unsigned long flags;
+
+	if (state != sm.state) {
+		sm.transitions++;
+		bq2589x_changed(BQ2589X_CHANGED_SM);
+	}
+	spin_lock_irqsave(&bq2589x_sm_lock, flags);
+	sm.state = state;
+	sm.due = jiffies + msecs_to_jiffies(delay_ms);
+	spin_unlock_irqrestore(&bq2589x_sm_lock, flags);
+}
+
+static void bq2589x_sm_adapter_out(struct bq2589x *bq)
+{
+	bq2589x_set_input_volt_limit(g_bq1, 4400);
+	if (g_bq2)
+		bq2589x_set_input_volt_limit(g_bq2, 4400);
+
+	WRITE_ONCE(bq->src_volt, 0);
+	WRITE_ONCE(bq->src_curr, 0);
+
+	pe.tune_up_volt = false;
+	pe.tune_down_volt = false;
+	pe.tune_done = false;
+	pe.at_12v = false;
+	chg2.tapering = false;
+
+	/* without VBUS it draws nothing, but it must not start the next session running */
+	if (g_bq2 && g_bq2->enabled) {
+		if (bq2589x_enter_hiz_mode(g_bq2))
+			dev_err(bq->dev, "%s: charger 2 enter hiz mode failed\n", __func__);
+		else
+			g_bq2->enabled = false;
+	}
+
+	/* not _sync, it may be waiting on the role lock; once in it sees IDLE and stops */
+	cancel_delayed_work(&bq->monitor_work);
+	bq2589x_watchdog_arm(bq, false);
+
+	bq2589x_bringup_abort();
+}
+
+/* consume posted events, the ones not applicable in this state stay queued */
+static void bq2589x_sm_handle_events(struct bq2589x *bq)
+{
+	unsigned long events;
+	unsigned long flags;
+
+	spin_lock_irqsave(&bq2589x_sm_lock, flags);
+	events = sm.events;
+	sm.events = 0;
+	spin_unlock_irqrestore(&bq2589x_sm_lock, flags);
+
+	if (events & BQ2589X_EV_PLUG_OUT) {
+		bq2589x_sm_adapter_out(bq);
+		bq2589x_sm_enter(BQ2589X_SM_IDLE, 0);
+		/* a replug already seen by the irq handler survives, a stale one does not */
+		if (!(bq->status & BQ2589X_STATUS_PLUGIN))
+			events &= ~BQ2589X_EV_PLUG_IN;
+		events &= ~(BQ2589X_EV_PLUG_OUT | BQ2589X_EV_STEADY | BQ2589X_EV_WARM);
+	}
+
+	if (events & BQ2589X_EV_PLUG_IN) {
+		sm.session++;
+		sm.wakeups = 1;
+		sm.transitions = 0;
+		sm.xfer_base = bq2589x_total_xfers();
+		sm.peak_xfers = 0;
+		sm.pe_tried = false;
+		sm.pe_skipped = false;
+		sm.adopted = false;
+		sm.ico_ma = 0;
+		sm.cache_hit = -1;
+		bq2589x_acct_reset();
+		bq2589x_dpm_reset();
+		bq2589x_step_reset();
+		bq2589x_sm_enter((events & BQ2589X_EV_WARM) ? BQ2589X_SM_WARM_START
+				 : BQ2589X_SM_ADAPTER_IN, 0);
+		events &= ~(BQ2589X_EV_PLUG_IN | BQ2589X_EV_SOURCE_CAP | BQ2589X_EV_STEADY);
+	}
+	events &= ~BQ2589X_EV_WARM;
+
+	if (events & BQ2589X_EV_SOURCE_CAP) {
+		/* contract arrived or went away after VBUS, drop whatever tuning is in flight */
+		if (sm.state != BQ2589X_SM_IDLE) {
+			if (!READ_ONCE(bq->src_volt))
+				bq2589x_drop_source_cap(bq);
+			bq2589x_sm_enter(BQ2589X_SM_ADAPTER_IN, 0);
+		}
+		events &= ~BQ2589X_EV_SOURCE_CAP;
+	}
+
+	if (sm.state == BQ2589X_SM_CHARGING) {
+		if (events & BQ2589X_EV_PE_ROLLBACK) {
+			bq2589x_pe_rollback_12v(bq);
+			bq2589x_sm_enter(BQ2589X_SM_PE_TUNE, 0);
+		} else if (events & BQ2589X_EV_PE_TUNE_DOWN) {
+			if (pe.enable && !READ_ONCE(bq->src_volt) && bq->vbus_type == BQ2589X_VBUS_USB_DCP && !pe.tune_down_volt) {
+				pe.at_12v = false;
+				bq2589x_pe_start_tune(false, pe.low_volt_level);
+				bq2589x_sm_enter(BQ2589X_SM_PE_TUNE, 0);
+			}
+		} else if (events & BQ2589X_EV_RERUN_ICO) {
+			bq2589x_sm_enter(BQ2589X_SM_ICO, 0);
+		}
+		events &= ~BQ2589X_EV_STEADY;
+	} else if (sm.state == BQ2589X_SM_IDLE) {
+		events &= ~BQ2589X_EV_STEADY;
+	}
+
+	if (events) {
+		spin_lock_irqsave(&bq2589x_sm_lock, flags);
+		sm.events |= events;
+		spin_unlock_irqrestore(&bq2589x_sm_lock, flags);
+	}
+}
+
+/*
+ * Bounds on one sm_work run. No chain of handlers needs more; hitting
+ * them means register contents or an event ordering the handlers don't
+ * expect are cycling the machine without progress.
+ */
+#define BQ2589X_SM_MAX_STEPS	16
+#define BQ2589X_SM_XFER_BUDGET	128
+
+BQ2589X_VISIBLE void bq2589x_sm_workfunc(struct work_struct *work)
+{
+	struct bq2589x *bq = container_of(work, struct bq2589x, sm_work.work);
+	bq2589x_sm_handler handler;
+	unsigned int delay_ms;
+	int steps = 0;
+	int next;
+
+	mutex_lock(&bq2589x_role_lock);
+	if (bq->otg_active) {
+		mutex_unlock(&bq2589x_role_lock);
+		return;
+	}
+
+	sm.wakeups++;
+	sm.task = current;
+	sm.run_xfers = 0;
+	bq2589x_sm_handle_events(bq);
+
+	while ((handler = bq2589x_sm_handlers[sm.state]) && time_after_eq(jiffies, sm.due)) {
+		if (++steps > BQ2589X_SM_MAX_STEPS) {
+			dev_warn_ratelimited(bq->dev, "%s:cycling in %s, backing off\n", __func__,
+				bq2589x_sm_state_name[sm.state]);
+			sm.due = jiffies + msecs_to_jiffies(1000);
+			break;
+		}
+		delay_ms = 0;
+		next = handler(bq, &delay_ms);
+		dev_dbg(bq->dev, "%s:%s -> %s +%ums\n", __func__, bq2589x_sm_state_name[sm.state],
+			bq2589x_sm_state_name[next], delay_ms);
+		bq2589x_sm_enter(next, delay_ms);
+
+		/* reached a steady state with steady-state requests waiting */
+		if (!bq2589x_sm_handlers[sm.state] && sm.events)
+			bq2589x_sm_handle_events(bq);
 	}
+
+	sm.task = NULL;
+	sm.peak_xfers = max(sm.peak_xfers, sm.run_xfers);
+	if (sm.run_xfers > BQ2589X_SM_XFER_BUDGET)
+		dev_warn_ratelimited(bq->dev, "%s:%u i2c transactions in one run\n", __func__,
+			sm.run_xfers);
+
+	if (handler)
+		mod_delayed_work(system_wq, &bq->sm_work, sm.due - jiffies);
+	mutex_unlock(&bq2589x_role_lock);
 }
 
-static void bq2589x_pe_tune_volt_workfunc(struct work_struct *work)
-{
-	struct bq2589x *bq = container_of(work, struct bq2589x, pe_volt_tune_work.work);
-	int ret;
-	static bool pumpx_cmd_issued;
 
-	g_bq1->vbus_volt = bq2589x_adc_read_vbus_volt(g_bq1);
+/*
+ * R = dVBAT/dICHG across a policy step, from consecutive monitor
+ * samples. Only CC samples count, in CV VBAT is held and the ratio
+ * means nothing. Both chargers get the estimate: each only boosts by
+ * its own share of the current, which keeps them under-compensated.
+ */
+static void bq2589x_ir_update(struct bq2589x *bq, int vbat, int ichg, bool cv)
+{
+	struct bq2589x *chg[] = { g_bq1, g_bq2 };
+	int dv = vbat - ir.vbat;
+	int di = ichg - ir.ichg;
+	int comp, clamp;
+	int r;
+	int i;
+
+	if (ir.expect && ir.ichg && !cv && abs(di) >= BQ2589X_IR_MIN_DELTA) {
+		r = dv * 1000 / di;
+		if (r > 0 && r <= BQ2589X_IR_MAX_SANE) {
+			ir.est = ir.samples ? ir.est + (r - ir.est) / 4 : r;
+			ir.samples++;
+			dev_info(bq->dev, "%s:%dmV over %dmA, %dmOhm, estimate %dmOhm\n",
+				__func__, dv, di, r, ir.est);
+		}
+	}
+	ir.expect = false;
+	ir.vbat = cv ? 0 : vbat;
+	ir.ichg = cv ? 0 : ichg;
 
-	dev_info(bq->dev, "%s:vbus voltage:%d, Tune Target Volt:%d\n", __func__, g_bq1->vbus_volt, pe.target_volt);
+	if (!ir.max_comp || ir.samples < BQ2589X_IR_MIN_SAMPLES)
+		return;
 
-	if ((pe.tune_up_volt && g_bq1->vbus_volt > pe.target_volt) ||
-	    (pe.tune_down_volt && g_bq1->vbus_volt < pe.target_volt)) {
-		dev_info(bq->dev, "%s:voltage tune successfully\n", __func__);
-		pe.tune_done = true;
-		bq2589x_adjust_absolute_vindpm(bq);
-		bq2589x_adjust_absolute_vindpm(g_bq2);
-		if (pe.tune_up_volt)
-			schedule_delayed_work(&bq->ico_work, 0);
+	/* 3/4 of the estimate, an overestimate would overcharge */
+	comp = min(ir.est * 3 / 4, ir.max_comp);
+	clamp = min(comp * BQ2589X_ICHG_MAX / 1000, ir.max_clamp);
+	comp = comp / BQ2589X_BAT_COMP_LSB * BQ2589X_BAT_COMP_LSB;
+	clamp = clamp / BQ2589X_VCLAMP_LSB * BQ2589X_VCLAMP_LSB;
+	if (comp == ir.comp && clamp == ir.clamp)
 		return;
-	}
 
-	if (pe.tune_count > 10) {
-		dev_info(bq->dev, "%s:voltage tune failed,reach max retry count\n", __func__);
-		pe.tune_fail = true;
-		bq2589x_adjust_absolute_vindpm(bq);
-		bq2589x_adjust_absolute_vindpm(g_bq2);
+	dev_info(bq->dev, "%s:ir compensation %dmOhm, clamp %dmV\n", __func__, comp, clamp);
+	for (i = 0; i < ARRAY_SIZE(chg); i++)
+		if (chg[i])
+			bq2589x_set_ir_comp(chg[i], comp, clamp);
+	ir.comp = comp;
+	ir.clamp = clamp;
+}
+
+/*
+ * Hill climb each charger's IINLIM toward what the source can sustain:
+ * back off a step while the chip sits in VDPM (VBUS collapsing) and
+ * remember that limit, probe a step up while it is only current limited
+ * (IDPM) and below the last collapse point. A persistent sag or a VBUS
+ * shift means the source changed, so ICO is run again from scratch.
+ */
+static void bq2589x_dpm_track(struct bq2589x *bq)
+{
+	struct bq2589x *chg[] = { g_bq1, g_bq2 };
+	struct limits_ctrl l;
+	bool vdpm_any = false;
+	int max_iinlim;
+	int ceiling;
+	int src_curr;
+	int vbus;
+	int iinlim;
+	int next;
+	u8 status;
+	int i;
 
-		if (pe.tune_up_volt)
-			schedule_delayed_work(&bq->ico_work, 0);
+	if (sm.state != BQ2589X_SM_CHARGING || bq->vbus_volt < 0)
 		return;
-	}
 
-	if (!pumpx_cmd_issued) {
-		if (pe.tune_up_volt)
-			ret = bq2589x_pumpx_increase_volt(bq);
-		else if (pe.tune_down_volt)
-			ret =  bq2589x_pumpx_decrease_volt(bq);
-		if (ret) {
-			schedule_delayed_work(&bq->pe_volt_tune_work, HZ);
-		} else {
-			dev_info(bq->dev, "%s:pumpx command issued.\n", __func__);
-			pumpx_cmd_issued = true;
-			pe.tune_count++;
-			schedule_delayed_work(&bq->pe_volt_tune_work, 3 * HZ);
+	max_iinlim = dpm.max_iinlim;
+	src_curr = READ_ONCE(bq->src_curr);
+	l = bq2589x_ulim_get();
+
+	for (i = 0; i < ARRAY_SIZE(chg); i++) {
+		if (!chg[i] || (i && !chg[i]->enabled))
+			continue;
+		if (bq2589x_read_byte(chg[i], &status, BQ2589X_REG_13))
+			continue;
+
+		iinlim = BQ2589X_DECODE(chg[i]->shadow[BQ2589X_REG_00], IINLIM);
+		next = iinlim;
+		ceiling = max_iinlim;
+		/* the contract bounds the pair, not each charger */
+		if (src_curr > 0)
+			ceiling = min(ceiling, bq2589x_limit_split(chg[i], src_curr));
+		if (l.iinlim >= 0)
+			ceiling = min(ceiling, bq2589x_limit_split(chg[i], l.iinlim));
+
+		if (iinlim > ceiling) {
+			/* charger 2 came in after this one was set for the whole contract */
+			next = ceiling;
+		} else if (status & BQ2589X_VDPM_STAT_MASK) {
+			vdpm_any = true;
+			dpm.ceiling[i] = iinlim;
+			next = max(iinlim - dpm.step, 500);
+		} else if ((status & BQ2589X_IDPM_STAT_MASK) && iinlim + dpm.step <= ceiling
+			   && (!dpm.ceiling[i] || iinlim + dpm.step < dpm.ceiling[i])) {
+			next = iinlim + dpm.step;
 		}
-	} else {
-		if (pe.tune_up_volt)
-			ret = bq2589x_pumpx_increase_volt_done(bq);
-		else if (pe.tune_down_volt)
-			ret = bq2589x_pumpx_decrease_volt_done(bq);
-		if (ret == 0) {/*finished for one step*/
-			dev_info(bq->dev, "%s:pumpx command finishedd!\n", __func__);
-			bq2589x_adjust_absolute_vindpm(bq);
-			bq2589x_adjust_absolute_vindpm(g_bq2);
-			pumpx_cmd_issued = 0;
+
+		if (next != iinlim) {
+			dev_info(bq->dev, "%s:charger%d %s, iinlim %d -> %dmA\n", __func__, i + 1,
+				iinlim > ceiling ? "over its share" : next < iinlim ? "in vdpm" : "in idpm",
+				iinlim, next);
+			bq2589x_request_iinlim(chg[i], next);
+			ir.expect = true;
 		}
-		schedule_delayed_work(&bq->pe_volt_tune_work, HZ);
 	}
-}
 
+	dpm.vdpm_cycles = vdpm_any ? dpm.vdpm_cycles + 1 : 0;
+
+	/* a single sample may be ripple, judge the shift on the monitor-rate median */
+	vbus = bq2589x_adc_median(bq, BQ2589X_CH_VBUSV);
+	if (vbus < 0)
+		vbus = 0;
+	if (!dpm.vbus_ref)
+		dpm.vbus_ref = vbus;
+
+	if (dpm.vdpm_cycles >= dpm.vdpm_rerun
+	    || (vbus && dpm.vbus_ref && abs(vbus - dpm.vbus_ref) > dpm.vbus_shift)) {
+		dev_info(bq->dev, "%s:source changed (vbus %d, was %d), re-running ico\n",
+			__func__, vbus, dpm.vbus_ref);
+		bq2589x_dpm_reset();
+		bq2589x_sm_post(bq, BQ2589X_EV_RERUN_ICO);
+	}
+}
 
-static void bq2589x_monitor_workfunc(struct work_struct *work)
+BQ2589X_VISIBLE void bq2589x_monitor_workfunc(struct work_struct *work)
 {
 	struct bq2589x *bq = container_of(work, struct bq2589x, monitor_work.work);
-	int ret;
 	int chg1_current;
-	int chg2_current;
+	int chg2_current = 0;
+	int phase;
+	u8 status;
+
+	/*
+	 * Re-armed from the battery notifier racing the unplug, or left over
+	 * from a session that has ended: don't keep the cycle going.
+	 */
+	mutex_lock(&bq2589x_role_lock);
+	if (bq->otg_active || sm.state == BQ2589X_SM_IDLE) {
+		mutex_unlock(&bq2589x_role_lock);
+		return;
+	}
 
 	dev_info(bq->dev, "%s\n", __func__);
+	bq2589x_shadow_check(g_bq1, false);
+	bq2589x_shadow_check(g_bq2, false);
 	bq2589x_reset_watchdog_timer(bq);
 
 	bq->rsoc = bq2589x_read_batt_rsoc(bq); 
 
-	g_bq1->vbus_volt = bq2589x_adc_read_vbus_volt(g_bq1);
-	g_bq1->vbat_volt = bq2589x_adc_read_battery_volt(g_bq1);
-
-	g_bq2->vbus_volt = bq2589x_adc_read_vbus_volt(g_bq2);
-	g_bq2->vbat_volt = bq2589x_adc_read_battery_volt(g_bq2);
+	/* never feed a failed read into policy, try again next cycle */
+	if (bq2589x_adc_sample(g_bq1, BQ2589X_MONITOR_MS)
+	    || (g_bq2 && bq2589x_adc_sample(g_bq2, BQ2589X_MONITOR_MS)))
+		goto out;
 
-	chg1_current = bq2589x_adc_read_charge_current(g_bq1);
-	chg2_current = bq2589x_adc_read_charge_current(g_bq2);
+	g_bq1->vbus_volt = bq2589x_adc_last(g_bq1, BQ2589X_CH_VBUSV);
+	g_bq1->vbat_volt = bq2589x_adc_last(g_bq1, BQ2589X_CH_BATV);
+	chg1_current = bq2589x_adc_last(g_bq1, BQ2589X_CH_ICHGR);
 
 	dev_info(bq->dev, "%s:charger1:vbus volt:%d,vbat volt:%d,charge current:%d\n",
-		__func__,g_bq1->vbus_volt,g_bq1->vbat_volt,chg1_current);
+		__func__, bq2589x_adc_ewma(g_bq1, BQ2589X_CH_VBUSV),
+		bq2589x_adc_ewma(g_bq1, BQ2589X_CH_BATV), bq2589x_adc_ewma(g_bq1, BQ2589X_CH_ICHGR));
 
-	dev_info(bq->dev, "%s:charger2:vbus volt:%d,vbat volt:%d,charge current:%d\n",
-		__func__,g_bq2->vbus_volt,g_bq2->vbat_volt,chg2_current);
+	if (g_bq2) {
+		g_bq2->vbus_volt = bq2589x_adc_last(g_bq2, BQ2589X_CH_VBUSV);
+		g_bq2->vbat_volt = bq2589x_adc_last(g_bq2, BQ2589X_CH_BATV);
+		chg2_current = bq2589x_adc_last(g_bq2, BQ2589X_CH_ICHGR);
 
-	if (g_bq2->enabled && g_bq1->rsoc > 95) {
-		ret = bq2589x_enter_hiz_mode(g_bq2);
-		if (ret) {
-			dev_err(g_bq1->dev, "%s: charger 2 enter hiz mode failed:%d\n", __func__, ret);
-		} else {
-			dev_info(g_bq1->dev, "%s: charger 2 enter hiz mode successfully\n", __func__);
-			g_bq2->enabled = false;
-		}
-		if (pe.enable && bq->vbus_type == BQ2589X_VBUS_USB_DCP && !pe.tune_down_volt) {
-			pe.tune_down_volt = true;
-			pe.tune_up_volt = false;
-			pe.target_volt = pe.low_volt_level;
-			pe.tune_done = false;
-			pe.tune_count = 0;
-			pe.tune_fail = false;
-			schedule_delayed_work(&bq->pe_volt_tune_work, 0);
-		}
+		dev_info(bq->dev, "%s:charger2:vbus volt:%d,vbat volt:%d,charge current:%d\n",
+			__func__, bq2589x_adc_ewma(g_bq2, BQ2589X_CH_VBUSV),
+			bq2589x_adc_ewma(g_bq2, BQ2589X_CH_BATV), bq2589x_adc_ewma(g_bq2, BQ2589X_CH_ICHGR));
 	}
 
+	if (g_bq1->vbus_volt < 0 || g_bq1->vbat_volt < 0 || chg1_current < 0
+	    || (g_bq2 && (g_bq2->vbat_volt < 0 || chg2_current < 0)))
+		goto out;
+
+	if (!bq2589x_read_byte(g_bq1, &status, BQ2589X_REG_0B)
+	    && g_bq1->chrg_stat != (status & BQ2589X_CHRG_STAT_MASK) >> BQ2589X_CHRG_STAT_SHIFT) {
+		/* phase changes without an interrupt, e.g. precharge to fast */
+		g_bq1->chrg_stat = (status & BQ2589X_CHRG_STAT_MASK) >> BQ2589X_CHRG_STAT_SHIFT;
+		bq2589x_changed(BQ2589X_CHANGED_PSY);
+	}
+
+	if (g_bq1->chrg_stat == BQ2589X_CHRG_STAT_CHGDONE)
+		phase = BQ2589X_PHASE_DONE;
+	else if (chg2.tapering)
+		phase = BQ2589X_PHASE_TAPER;
+	else if (g_bq2 && g_bq2->enabled)
+		phase = BQ2589X_PHASE_DUAL;
+	else if (g_bq1->vbus_volt > 6000)
+		phase = BQ2589X_PHASE_BOOSTED;
+	else
+		phase = BQ2589X_PHASE_5V_SINGLE;
+
+	bq2589x_acct_update(phase, g_bq1->vbat_volt, chg1_current,
+		g_bq2 ? g_bq2->vbat_volt : 0, (g_bq2 && g_bq2->enabled) ? chg2_current : 0);
+
+	bq2589x_ir_update(bq, g_bq1->vbat_volt,
+		chg1_current + ((g_bq2 && g_bq2->enabled) ? chg2_current : 0),
+		g_bq1->chrg_stat != BQ2589X_CHRG_STAT_FASTCHG
+		|| g_bq1->vbat_volt >= bq2589x_vreg(bq) - chg2.cv_margin);
+	bq2589x_jeita_update(bq);
+	bq2589x_step_update(bq, g_bq1->vbat_volt);
+
+	if (g_bq2 && g_bq2->enabled)
+		bq2589x_charger2_taper(bq, g_bq1->vbat_volt,
+			(chg1_current < 0 || chg2_current < 0) ? -1 : chg1_current + chg2_current);
+
+	if (pe.at_12v && pe.tune_done && g_bq1->vbus_volt < pe.high_volt_12v_level) {
+		/* source can't hold 12v under the dual charger load */
+		pe.at_12v = false;
+		bq2589x_sm_post(bq, BQ2589X_EV_PE_ROLLBACK);
+	}
+
+	bq2589x_dpm_track(bq);
+
 	/* read temperature,or any other check if need to decrease charge current*/
 
-	schedule_delayed_work(&bq->monitor_work, 10 * HZ);
+out:
+	schedule_delayed_work(&bq->monitor_work, msecs_to_jiffies(BQ2589X_MONITOR_MS));
+	mutex_unlock(&bq2589x_role_lock);
 }
 
 static void check_adapter_type(struct bq2589x *bq)
 {
-	if (!bq->cfg.enable_auto_dpdm && bq2589x_force_dpdm(bq)) {
+	if (READ_ONCE(bq->src_volt) > 0) {
+		/* contract known from the port controller, skip BC1.2 detection */
+		bq->vbus_type = bq2589x_get_vbus_type(bq);
+		if (bq->vbus_type == BQ2589X_VBUS_NONE && bq2589x_adc_read_vbus_volt(bq) > 4000)
+			bq->vbus_type = BQ2589X_VBUS_UNKNOWN;
+	} else if (!bq->cfg.enable_auto_dpdm && bq2589x_force_dpdm(bq)) {
 		dev_err(bq->dev,"failed to do force dpdm, vbus type is forced to DCP\n");
 		bq->vbus_type = BQ2589X_VBUS_USB_DCP;
 	} else{
@@ -1395,38 +4179,60 @@ static void check_adapter_type(struct bq2589x *bq)
 	}
 }
 
-static void bq2589x_charger1_irq_workfunc(struct work_struct *work)
+BQ2589X_VISIBLE void bq2589x_charger1_irq_workfunc(struct work_struct *work)
 {
 	struct bq2589x *bq = container_of(work, struct bq2589x, irq_work);
+	unsigned int old_status;
+	u8 old_stat;
 	u8 status = 0;
 	u8 fault = 0;
+	bool warm;
 	int ret;
 
+	/* never race the deferred register setup */
+	flush_work(&bq->init_work);
+
 	msleep(5);
 
-	if (!(bq->status & BQ2589X_STATUS_PLUGIN))
+	mutex_lock(&bq2589x_role_lock);
+	old_status = bq->status;
+	old_stat = bq->chrg_stat;
+	warm = bq->warm;	/* only the first run after probe can resume */
+	bq->warm = false;
+
+	if (!(bq->status & BQ2589X_STATUS_PLUGIN) && !warm)
 		check_adapter_type(bq);
-	else
-		bq->vbus_type = bq2589x_get_vbus_type(bq);
 
 	/* Read STATUS and FAULT registers */
 	ret = bq2589x_read_byte(bq, &status, BQ2589X_REG_0B);
 	if (ret)
-		return;
+		goto out;
 
 	ret = bq2589x_read_byte(bq, &fault, BQ2589X_REG_0C);
 	if (ret)
-		return;
+		goto out;
+
+	/*
+	 * Resuming keeps the detection result the chip still holds, no BC1.2
+	 * rerun. Taken from the status just read: a failed read of its own
+	 * would look like VBUS_NONE and end the session.
+	 */
+	if ((bq->status & BQ2589X_STATUS_PLUGIN) || warm)
+		bq->vbus_type = (status & BQ2589X_VBUS_STAT_MASK) >> BQ2589X_VBUS_STAT_SHIFT;
+
+	if (fault & BQ2589X_FAULT_WDT_MASK)
+		bq2589x_shadow_check(bq, true);
 
 
 	if ((bq->vbus_type == BQ2589X_VBUS_NONE || bq->vbus_type  == BQ2589X_VBUS_OTG) && (bq->status & BQ2589X_STATUS_PLUGIN)) {
 		dev_info(bq->dev, "%s:adapter removed\n", __func__);
 		bq->status &= ~BQ2589X_STATUS_PLUGIN;
-		schedule_work(&bq->adapter_out_work);
+		bq2589x_sm_post(bq, BQ2589X_EV_PLUG_OUT);
 	} else if (bq->vbus_type != BQ2589X_VBUS_NONE && bq->vbus_type != BQ2589X_VBUS_OTG && !(bq->status & BQ2589X_STATUS_PLUGIN)) {
 		dev_info(bq->dev, "%s:adapter plugged in\n", __func__);
 		bq->status |= BQ2589X_STATUS_PLUGIN;
-		schedule_work(&bq->adapter_in_work);
+		bq2589x_bringup_start(bq->irq_time);
+		bq2589x_sm_post(bq, BQ2589X_EV_PLUG_IN | (warm ? BQ2589X_EV_WARM : 0));
 	}
 
 	if ((status & BQ2589X_PG_STAT_MASK) && !(bq->status & BQ2589X_STATUS_PG))
@@ -1439,19 +4245,334 @@ static void bq2589x_charger1_irq_workfunc(struct work_struct *work)
 	else if (!fault && (bq->status & BQ2589X_STATUS_FAULT))
 		bq->status &= ~BQ2589X_STATUS_FAULT;
 
+	bq->chrg_stat = (status & BQ2589X_CHRG_STAT_MASK) >> BQ2589X_CHRG_STAT_SHIFT;
+
+	/* plug, power good, fault and charge phase changes all reach userspace */
+	if (bq->status != old_status || bq->chrg_stat != old_stat)
+		bq2589x_changed(BQ2589X_CHANGED_PSY);
+
 	bq->interrupt = true;
+out:
+	mutex_unlock(&bq2589x_role_lock);
 }
 
 
-static irqreturn_t bq2589x_charger1_interrupt(int irq, void *data)
+BQ2589X_VISIBLE irqreturn_t bq2589x_charger1_interrupt(int irq, void *data)
 {
 	struct bq2589x *bq = data;
 
+	bq->irq_time = bq2589x_now();
 	schedule_work(&bq->irq_work);
 	return IRQ_HANDLED;
 }
 
 
+/*
+ * OTG boost exposed as a VBUS regulator. The charge path and the boost
+ * path are switched with a single REG03 write, and the charge side
+ * machinery (PE, ICO, charger 2, monitor) is quiesced before sourcing
+ * so a role swap never leaves both paths active.
+ */
+static const int bq2589x_boost_lim_ma[] = {
+	500, 700, 1100, 1300, 1600, 1800, 2100, 2400,
+};
+
+#define BQ2589X_OTG_ENABLE_TIME_US	5000
+
+/*
+ * Caller holds the role lock with otg_active set: a charge side work
+ * still queued or waiting on the lock finds it and backs out, so the
+ * cancels need not wait.
+ */
+static void bq2589x_suspend_charge_side(struct bq2589x *bq)
+{
+	unsigned long flags;
+
+	cancel_delayed_work(&bq->sm_work);
+	bq2589x_sm_adapter_out(bq);
+
+	/* the session restarts from a fresh plug in once the role swaps back */
+	spin_lock_irqsave(&bq2589x_sm_lock, flags);
+	sm.events = 0;
+	sm.state = BQ2589X_SM_IDLE;
+	spin_unlock_irqrestore(&bq2589x_sm_lock, flags);
+	bq->status &= ~BQ2589X_STATUS_PLUGIN;
+}
+
+static int bq2589x_otg_switch(struct bq2589x *bq, bool enable)
+{
+	u8 val;
+	int ret;
+
+	mutex_lock(&bq2589x_role_lock);
+	if (enable) {
+		bq->otg_active = true;
+		bq2589x_suspend_charge_side(bq);
+		if (g_bq2 && !bq2589x_enter_hiz_mode(g_bq2))
+			g_bq2->enabled = false;
+		val = (BQ2589X_OTG_ENABLE << BQ2589X_OTG_CONFIG_SHIFT)
+			| (BQ2589X_CHG_DISABLE << BQ2589X_CHG_CONFIG_SHIFT);
+	} else {
+		val = (BQ2589X_OTG_DISABLE << BQ2589X_OTG_CONFIG_SHIFT)
+			| (BQ2589X_CHG_ENABLE << BQ2589X_CHG_CONFIG_SHIFT);
+	}
+
+	ret = bq2589x_update_bits(bq, BQ2589X_REG_03,
+			BQ2589X_OTG_CONFIG_MASK | BQ2589X_CHG_CONFIG_MASK, val);
+	if (ret) {
+		/* still charging, the suspended session starts over from detection */
+		if (enable) {
+			bq->otg_active = false;
+			schedule_work(&bq->irq_work);
+		}
+		goto out;
+	}
+
+	if (enable) {
+		bq->status &= ~BQ2589X_STATUS_CHARGE_ENABLE;
+	} else {
+		bq->status |= BQ2589X_STATUS_CHARGE_ENABLE;
+		bq->otg_active = false;
+		/* resume the charge side, an adapter may be waiting */
+		schedule_work(&bq->irq_work);
+	}
+
+	bq2589x_changed(BQ2589X_CHANGED_PSY | BQ2589X_CHANGED_SM);
+out:
+	mutex_unlock(&bq2589x_role_lock);
+	return ret;
+}
+
+static int bq2589x_otg_regulator_enable(struct regulator_dev *rdev)
+{
+	return bq2589x_otg_switch(rdev_get_drvdata(rdev), true);
+}
+
+static int bq2589x_otg_regulator_disable(struct regulator_dev *rdev)
+{
+	return bq2589x_otg_switch(rdev_get_drvdata(rdev), false);
+}
+
+/* what the chip does, not what was last asked of it */
+static int bq2589x_otg_regulator_is_enabled(struct regulator_dev *rdev)
+{
+	struct bq2589x *bq = rdev_get_drvdata(rdev);
+	u8 val;
+	int ret;
+
+	ret = bq2589x_read_byte(bq, &val, BQ2589X_REG_03);
+	if (ret)
+		return ret;
+
+	return !!(val & BQ2589X_OTG_CONFIG_MASK);
+}
+
+static int bq2589x_otg_set_voltage_sel(struct regulator_dev *rdev, unsigned sel)
+{
+	struct bq2589x *bq = rdev_get_drvdata(rdev);
+
+	return bq2589x_update_bits(bq, BQ2589X_REG_0A, BQ2589X_BOOSTV_MASK, sel << BQ2589X_BOOSTV_SHIFT);
+}
+
+static int bq2589x_otg_get_voltage_sel(struct regulator_dev *rdev)
+{
+	struct bq2589x *bq = rdev_get_drvdata(rdev);
+	u8 val;
+	int ret;
+
+	ret = bq2589x_read_byte(bq, &val, BQ2589X_REG_0A);
+	if (ret)
+		return ret;
+
+	return (val & BQ2589X_BOOSTV_MASK) >> BQ2589X_BOOSTV_SHIFT;
+}
+
+static int bq2589x_otg_set_current_limit(struct regulator_dev *rdev, int min_ua, int max_ua)
+{
+	struct bq2589x *bq = rdev_get_drvdata(rdev);
+	int i;
+
+	for (i = ARRAY_SIZE(bq2589x_boost_lim_ma) - 1; i >= 0; i--) {
+		if (bq2589x_boost_lim_ma[i] * 1000 <= max_ua)
+			break;
+	}
+	if (i < 0 || bq2589x_boost_lim_ma[i] * 1000 < min_ua)
+		return -EINVAL;
+
+	return bq2589x_update_bits(bq, BQ2589X_REG_0A, BQ2589X_BOOST_LIM_MASK, i << BQ2589X_BOOST_LIM_SHIFT);
+}
+
+static int bq2589x_otg_get_current_limit(struct regulator_dev *rdev)
+{
+	struct bq2589x *bq = rdev_get_drvdata(rdev);
+	u8 val;
+	int ret;
+
+	ret = bq2589x_read_byte(bq, &val, BQ2589X_REG_0A);
+	if (ret)
+		return ret;
+
+	return bq2589x_boost_lim_ma[(val & BQ2589X_BOOST_LIM_MASK) >> BQ2589X_BOOST_LIM_SHIFT] * 1000;
+}
+
+static struct regulator_ops bq2589x_otg_regulator_ops = {
+	.enable = bq2589x_otg_regulator_enable,
+	.disable = bq2589x_otg_regulator_disable,
+	.is_enabled = bq2589x_otg_regulator_is_enabled,
+	.list_voltage = regulator_list_voltage_linear,
+	.map_voltage = regulator_map_voltage_linear,
+	.set_voltage_sel = bq2589x_otg_set_voltage_sel,
+	.get_voltage_sel = bq2589x_otg_get_voltage_sel,
+	.set_current_limit = bq2589x_otg_set_current_limit,
+	.get_current_limit = bq2589x_otg_get_current_limit,
+};
+
+static const struct regulator_desc bq2589x_otg_regulator_desc = {
+	.name = "bq2589x-otg-vbus",
+	.ops = &bq2589x_otg_regulator_ops,
+	.type = REGULATOR_VOLTAGE,
+	.owner = THIS_MODULE,
+	.min_uV = BQ2589X_BOOSTV_BASE * 1000,
+	.uV_step = BQ2589X_BOOSTV_LSB * 1000,
+	.n_voltages = (BQ2589X_BOOSTV_MASK >> BQ2589X_BOOSTV_SHIFT) + 1,
+	.enable_time = BQ2589X_OTG_ENABLE_TIME_US,
+};
+
+static int bq2589x_otg_regulator_register(struct bq2589x *bq)
+{
+	struct regulator_config config = { };
+	struct device_node *np = NULL;
+
+	if (bq->dev->of_node)
+		np = of_get_child_by_name(bq->dev->of_node, "otg-vbus");
+
+	config.dev = bq->dev;
+	config.driver_data = bq;
+	config.of_node = np;
+	if (np)
+		config.init_data = of_get_regulator_init_data(bq->dev, np, &bq2589x_otg_regulator_desc);
+
+	bq->otg_rdev = devm_regulator_register(bq->dev, &bq2589x_otg_regulator_desc, &config);
+	of_node_put(np);
+	if (IS_ERR(bq->otg_rdev)) {
+		dev_err(bq->dev, "%s:failed to register otg regulator:%ld\n", __func__, PTR_ERR(bq->otg_rdev));
+		return PTR_ERR(bq->otg_rdev);
+	}
+
+	return 0;
+}
+
+static int bq2589x_source_cap_notifier(struct notifier_block *nb, unsigned long event, void *data)
+{
+	struct bq2589x *bq = container_of(nb, struct bq2589x, source_nb);
+	struct bq2589x_source_cap *cap = data;
+
+	if (cap->volt > 0 && cap->curr <= 0)
+		return NOTIFY_DONE;
+	/* nothing to withdraw */
+	if (cap->volt <= 0 && READ_ONCE(bq->src_volt) <= 0)
+		return NOTIFY_DONE;
+
+	dev_info(bq->dev, "%s:source capability %dmV/%dmA\n", __func__, cap->volt, cap->curr);
+
+	WRITE_ONCE(bq->src_volt, max(cap->volt, 0));
+	WRITE_ONCE(bq->src_curr, cap->volt > 0 ? cap->curr : 0);
+
+	/* a withdrawn contract goes through the SM too, to restore the defaults */
+	if ((bq->status & BQ2589X_STATUS_PLUGIN) && !bq->otg_active)
+		bq2589x_sm_post(bq, BQ2589X_EV_SOURCE_CAP);
+
+	return NOTIFY_OK;
+}
+
+/*
+ * Register setup runs off the probe path; the chip charges on its
+ * power-on defaults meanwhile. Detection starts once it is done.
+ */
+static void bq2589x_charger1_init_workfunc(struct work_struct *work)
+{
+	struct bq2589x *bq = container_of(work, struct bq2589x, init_work);
+	int ret;
+
+	ret = bq2589x_init_device(bq);
+	if (ret)
+		dev_err(bq->dev, "device init failure: %d\n", ret);
+
+	/* gauge registered before us, take a first snapshot */
+	schedule_work(&bq->batt_work);
+
+	/*in case of adapter has been in when power off*/
+	bq->irq_time = bq2589x_now();
+	schedule_work(&bq->irq_work);
+}
+
+static void bq2589x_batt_release(struct bq2589x *bq)
+{
+	if (bq->batt_dev)
+		put_device(bq->batt_dev);
+	bq->batt_dev = NULL;
+	bq->batt_psy = NULL;
+	bq->batt_valid = false;
+	bq->batt_temp_valid = false;
+}
+
+/*
+ * Only batt_work touches the gauge. Looked up again on every push, a
+ * gauge that unregistered is dropped rather than dereferenced and a new
+ * one is picked up. The reference the lookup takes is the one held;
+ * this power_supply API has no power_supply_put(), it goes through the
+ * device, remembered apart since the supply may be gone by then.
+ */
+static bool bq2589x_batt_resolve(struct bq2589x *bq)
+{
+	struct power_supply *psy = power_supply_get_by_name("battery");
+
+	if (psy && psy == bq->batt_psy) {
+		put_device(psy->dev);	/* already holding one */
+		return true;
+	}
+
+	bq2589x_batt_release(bq);
+	if (!psy)
+		return false;
+
+	bq->batt_psy = psy;
+	bq->batt_dev = psy->dev;
+	return true;
+}
+
+/* the gauge pushes capacity changes, no polling of the battery supply */
+static void bq2589x_batt_workfunc(struct work_struct *work)
+{
+	struct bq2589x *bq = container_of(work, struct bq2589x, batt_work);
+
+	if (!bq2589x_batt_resolve(bq))
+		return;
+
+	bq2589x_update_batt(bq);
+	bq->rsoc = bq2589x_read_batt_rsoc(bq);
+
+	mutex_lock(&bq2589x_role_lock);
+	/* act on the threshold crossing now rather than on the next monitor cycle */
+	if (!bq->otg_active && (bq->status & BQ2589X_STATUS_PLUGIN)
+	    && g_bq2 && g_bq2->enabled && !chg2.tapering && bq->rsoc >= chg2.exit_soc)
+		mod_delayed_work(system_wq, &bq->monitor_work, 0);
+	mutex_unlock(&bq2589x_role_lock);
+}
+
+static int bq2589x_batt_notifier(struct notifier_block *nb, unsigned long event, void *data)
+{
+	struct bq2589x *bq = container_of(nb, struct bq2589x, psy_nb);
+	struct power_supply *psy = data;
+
+	if (event != PSY_EVENT_PROP_CHANGED || strcmp(psy->name, "battery"))
+		return NOTIFY_DONE;
+
+	schedule_work(&bq->batt_work);
+
+	return NOTIFY_OK;
+}
+
 #define GPIO_IRQ    80
 static int bq2589x_charger1_probe(struct i2c_client *client,
 			   const struct i2c_device_id *id)
@@ -1469,21 +4590,22 @@ static int bq2589x_charger1_probe(struct i2c_client *client,
 
 	bq->dev = &client->dev;
 	bq->client = client;
+	bq->primary = true;
 	i2c_set_clientdata(client, bq);
+	mutex_init(&bq->reg_lock);
+	bq2589x_trace_init(bq);
+	bq2589x_adc_filter_init(bq);
 
 	ret = bq2589x_detect_device(bq);
-	if (!ret && bq->part_no == BQ25890) {
+	/* charger 1 owns adapter detection, it needs the D+/D- block */
+	if (!ret && bq2589x_has(bq, BQ2589X_FEAT_DPDM)) {
 		bq->status |= BQ2589X_STATUS_EXIST;
-		dev_info(bq->dev, "%s: charger device bq25890 detected, revision:%d\n", __func__, bq->revision);
+		dev_info(bq->dev, "%s: charger device %s detected, revision:%d\n", __func__, bq->variant->name, bq->revision);
 	} else {
-		dev_info(bq->dev, "%s: no bq25890 charger device found:%d\n", __func__, ret);
+		dev_info(bq->dev, "%s: no usable charger 1 device found, pn:%d ret:%d\n", __func__, bq->part_no, ret);
 		return -ENODEV;
 	}
 
-	bq->batt_psy = power_supply_get_by_name("battery");
-
-	g_bq1 = bq;
-
 #if 0
 	 /*by default adapter output 5v, if >4.4v,it is ok after tune up*/
 	pe.high_volt_level = 4400;
@@ -1494,13 +4616,7 @@ static int bq2589x_charger1_probe(struct i2c_client *client,
 #endif
 
 	if (client->dev.of_node)
-		 bq2589x_parse_dt(&client->dev, g_bq1);
-
-	ret = bq2589x_init_device(g_bq1);
-	if (ret) {
-		dev_err(bq->dev, "device init failure: %d\n", ret);
-		goto err_0;
-	}
+		 bq2589x_parse_dt(&client->dev, bq);
 
 	ret = gpio_request(GPIO_IRQ, "bq2589x irq pin");
 	if (ret) {
@@ -1520,16 +4636,19 @@ static int bq2589x_charger1_probe(struct i2c_client *client,
 
 	ret = bq2589x_psy_register(bq);
 	if (ret)
-		goto err_0;
+		goto err_1;
 
+	INIT_WORK(&bq->init_work, bq2589x_charger1_init_workfunc);
 	INIT_WORK(&bq->irq_work, bq2589x_charger1_irq_workfunc);
-	INIT_WORK(&bq->adapter_in_work, bq2589x_adapter_in_workfunc);
-	INIT_WORK(&bq->adapter_out_work, bq2589x_adapter_out_workfunc);
+	INIT_WORK(&bq->batt_work, bq2589x_batt_workfunc);
+	INIT_DELAYED_WORK(&bq->sm_work, bq2589x_sm_workfunc);
+	INIT_DELAYED_WORK(&bq->notify_work, bq2589x_notify_workfunc);
 	INIT_DELAYED_WORK(&bq->monitor_work, bq2589x_monitor_workfunc);
-	INIT_DELAYED_WORK(&bq->ico_work, bq2589x_ico_workfunc);
-	INIT_DELAYED_WORK(&bq->pe_volt_tune_work, bq2589x_pe_tune_volt_workfunc);
-	INIT_DELAYED_WORK(&bq->check_pe_tuneup_work, bq2589x_check_pe_tuneup_workfunc);
-	INIT_DELAYED_WORK(&bq->charger2_enable_work, bq2589x_charger2_enable_workfunc);
+	INIT_DELAYED_WORK(&bq->limits_work, bq2589x_limits_workfunc);
+
+	g_bq1 = bq;
+	pe.enable = bq2589x_has(bq, BQ2589X_FEAT_PUMPX);
+	schedule_work(&bq->init_work);
 
 	ret = sysfs_create_group(&bq->dev->kobj, &bq2589x_attr_group);
 	if (ret) {
@@ -1537,22 +4656,44 @@ static int bq2589x_charger1_probe(struct i2c_client *client,
 		goto err_irq;
 	}
 
+	ret = bq2589x_otg_regulator_register(bq);
+	if (ret)
+		goto err_sysfs;
+
 	ret = request_irq(client->irq, bq2589x_charger1_interrupt, IRQF_TRIGGER_FALLING | IRQF_ONESHOT, "bq2589x_charger1_irq", bq);
 	if (ret) {
 		dev_err(bq->dev, "%s:Request IRQ %d failed: %d\n", __func__, client->irq, ret);
-		goto err_irq;
+		goto err_sysfs;
 	} else {
 		dev_info(bq->dev, "%s:irq = %d\n", __func__, client->irq);
 	}
 
 
-	pe.enable = true;
-	/*in case of adapter has been in when power off*/
-	schedule_work(&bq->irq_work);
+	bq->source_nb.notifier_call = bq2589x_source_cap_notifier;
+	blocking_notifier_chain_register(&bq2589x_source_notifier, &bq->source_nb);
+
+	bq->psy_nb.notifier_call = bq2589x_batt_notifier;
+	ret = power_supply_reg_notifier(&bq->psy_nb);
+	if (ret)
+		dev_err(bq->dev, "%s:failed to register psy notifier:%d\n", __func__, ret);
+
+	bq2589x_trace_debugfs(bq);
+
 	return 0;
 
+err_sysfs:
+	sysfs_remove_group(&bq->dev->kobj, &bq2589x_attr_group);
 err_irq:
+	/* init_work may already have kicked off irq_work and the SM behind it */
+	cancel_work_sync(&bq->init_work);
+	cancel_work_sync(&bq->batt_work);
 	cancel_work_sync(&bq->irq_work);
+	cancel_delayed_work_sync(&bq->sm_work);
+	cancel_delayed_work_sync(&bq->monitor_work);
+	cancel_delayed_work_sync(&bq->limits_work);
+	cancel_delayed_work_sync(&bq->notify_work);
+	bq2589x_batt_release(bq);
+	bq2589x_psy_unregister(bq);
 err_1:
 	gpio_free(GPIO_IRQ);
 err_0:
@@ -1566,17 +4707,21 @@ static void bq2589x_charger1_shutdown(struct i2c_client *client)
 
 	dev_info(bq->dev, "%s: shutdown\n", __func__);
 
-	bq2589x_psy_unregister(bq);
-
 	sysfs_remove_group(&bq->dev->kobj, &bq2589x_attr_group);
+	debugfs_remove_recursive(bq->debug_dir);
+	blocking_notifier_chain_unregister(&bq2589x_source_notifier, &bq->source_nb);
+	power_supply_unreg_notifier(&bq->psy_nb);
+	cancel_work_sync(&bq->init_work);
+	cancel_work_sync(&bq->batt_work);
 	cancel_work_sync(&bq->irq_work);
-	cancel_work_sync(&bq->adapter_in_work);
-	cancel_work_sync(&bq->adapter_out_work);
+	cancel_delayed_work_sync(&bq->sm_work);
 	cancel_delayed_work_sync(&bq->monitor_work);
-	cancel_delayed_work_sync(&bq->ico_work);
-	cancel_delayed_work_sync(&bq->check_pe_tuneup_work);
-	cancel_delayed_work_sync(&bq->charger2_enable_work);
-	cancel_delayed_work_sync(&bq->pe_volt_tune_work);
+	cancel_delayed_work_sync(&bq->limits_work);
+	/* last, the works above may still have queued a notification */
+	cancel_delayed_work_sync(&bq->notify_work);
+	bq2589x_batt_release(bq);
+
+	bq2589x_psy_unregister(bq);
 
 	free_irq(bq->client->irq, NULL);
 	gpio_free(GPIO_IRQ);
@@ -1602,6 +4747,9 @@ static void bq2589x_charger2_irq_workfunc(struct work_struct *work)
 	if (ret)
 		return;
 
+	if (fault & BQ2589X_FAULT_WDT_MASK)
+		bq2589x_shadow_check(bq, true);
+
 	if (((status & BQ2589X_VBUS_STAT_MASK) == 0) && (bq->status & BQ2589X_STATUS_PLUGIN))
 		bq->status &= ~BQ2589X_STATUS_PLUGIN;
     else if ((status & BQ2589X_VBUS_STAT_MASK) && !(bq->status & BQ2589X_STATUS_PLUGIN))
@@ -1620,6 +4768,34 @@ static void bq2589x_charger2_irq_workfunc(struct work_struct *work)
 	bq->interrupt = true;
 
 }
+static void bq2589x_charger2_init_workfunc(struct work_struct *work)
+{
+	struct bq2589x *bq = container_of(work, struct bq2589x, init_work);
+	int ret;
+
+	ret = bq2589x_init_device(bq);
+	if (ret)
+		dev_err(bq->dev, "%s:Failed to initialize bq2589x charger\n", __func__);
+	else
+		dev_info(bq->dev, "%s: Initialize bq2589x charger successfully!\n", __func__);
+
+	/* publish only once configured, charger 1 may already be mid session */
+	mutex_lock(&bq2589x_role_lock);
+	/* still charging from before the reboot, adopt it, charger 1 reconciles */
+	if (!ret && bq->warm && !(bq->shadow[BQ2589X_REG_00] & BQ2589X_ENHIZ_MASK)) {
+		bq->enabled = true;
+		sm.adopted = true;
+		chg2.ichg = BQ2589X_DECODE(bq->shadow[BQ2589X_REG_04], ICHG);
+		chg2.tapering = chg2.ichg < bq->cfg.charge_current;
+	}
+	mutex_lock(&bq2589x_chg2_lock);
+	g_bq2 = bq;
+	mutex_unlock(&bq2589x_chg2_lock);
+	if (g_bq1 && (g_bq1->status & BQ2589X_STATUS_PLUGIN) && !bq->enabled)
+		bq2589x_sm_post(g_bq1, BQ2589X_EV_RERUN_ICO);
+	mutex_unlock(&bq2589x_role_lock);
+}
+
 #if 0
 static irqreturn_t bq2589x_charger2_interrupt(int irq, void *data)
 {
@@ -1635,6 +4811,7 @@ static int bq2589x_charger2_probe(struct i2c_client *client,
 			   const struct i2c_device_id *id)
 {
 	struct bq2589x *bq;
+	u8 val;
 
 	int ret;
 
@@ -1647,29 +4824,38 @@ static int bq2589x_charger2_probe(struct i2c_client *client,
 	bq->dev = &client->dev;
 	bq->client = client;
 	i2c_set_clientdata(client, bq);
+	mutex_init(&bq->reg_lock);
+	bq2589x_trace_init(bq);
+	bq2589x_adc_filter_init(bq);
 
 	ret = bq2589x_detect_device(bq);
-	if (!ret && bq->part_no == BQ25892) {
+	if (!ret) {
 		bq->status |= BQ2589X_STATUS_EXIST;
-		dev_info(bq->dev, "%s: charger device bq25892 detected, revision:%d\n", __func__, bq->revision);
+		dev_info(bq->dev, "%s: charger device %s detected, revision:%d\n", __func__, bq->variant->name, bq->revision);
 	} else {
-		dev_info(bq->dev, "%s: no charger device bq25892 found:%d\n", __func__, ret);
+		dev_info(bq->dev, "%s: no charger 2 device found, pn:%d ret:%d\n", __func__, bq->part_no, ret);
 		return -ENODEV;
 	}
 
-	g_bq2 = bq;
+    /*disable charger 2 right away, the rest of the setup is deferred*/
+	/* unless a previous instance configured it, then it may be charging on purpose */
+	ret = bq2589x_read_byte(bq, &val, BQ2589X_REG_01);
+	if (ret || !bq2589x_configured(val)) {
+		ret = bq2589x_enter_hiz_mode(bq);
+		if (ret)
+			dev_err(bq->dev, "%s:Failed to enter hiz charger 2:%d\n", __func__, ret);
+	}
 
-    /*initialize bq2589x, disable charger 2 by default*/
 	if (client->dev.of_node)
-		 bq2589x_parse_dt(&client->dev, g_bq2);
-	ret = bq2589x_init_device(g_bq2);
-	if (ret)
-		dev_err(bq->dev, "%s:Failed to initialize bq2589x charger\n", __func__);
-    else
-		dev_info(bq->dev, "%s: Initialize bq2589x charger successfully!\n", __func__);
+		 bq2589x_parse_dt(&client->dev, bq);
+
     /* platform setup, irq,...*/
+	INIT_WORK(&bq->init_work, bq2589x_charger2_init_workfunc);
 	INIT_WORK(&bq->irq_work, bq2589x_charger2_irq_workfunc);
 
+	schedule_work(&bq->init_work);
+	bq2589x_trace_debugfs(bq);
+
 	return 0;
 }
 
@@ -1678,8 +4864,28 @@ static void bq2589x_charger2_shutdown(struct i2c_client *client)
 	struct bq2589x *bq = i2c_get_clientdata(client);
 
 	dev_info(bq->dev, "%s: shutdown\n", __func__);
+	debugfs_remove_recursive(bq->debug_dir);
+	cancel_work_sync(&bq->init_work);
 	cancel_work_sync(&bq->irq_work);
-	g_bq2 = NULL;
+
+	/*
+	 * Charger 1's works only use g_bq2 with the role lock held, holding
+	 * it here keeps them all out while charger 2 is taken off the pair.
+	 */
+	mutex_lock(&bq2589x_role_lock);
+	if (g_bq2 == bq) {
+		if (bq->enabled && !bq2589x_enter_hiz_mode(bq))
+			bq->enabled = false;
+		chg2.tapering = false;
+		mutex_lock(&bq2589x_chg2_lock);
+		g_bq2 = NULL;
+		mutex_unlock(&bq2589x_chg2_lock);
+		/* charger 1 alone again, it may take the whole input */
+		bq2589x_limits_resplit();
+		if (g_bq1 && (g_bq1->status & BQ2589X_STATUS_PLUGIN) && !g_bq1->otg_active)
+			bq2589x_sm_post(g_bq1, BQ2589X_EV_RERUN_ICO);
+	}
+	mutex_unlock(&bq2589x_role_lock);
 }
 
 static struct of_device_id bq2589x_charger1_match_table[] = {
@@ -1699,6 +4905,9 @@ static struct i2c_driver bq2589x_charger1_driver = {
 	.driver		= {
 		.name	= "bq2589x-1",
 		.of_match_table = bq2589x_charger1_match_table,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#endif
 	},
 	.id_table	= bq2589x_charger1_id,
 
@@ -1723,6 +4932,9 @@ static struct i2c_driver bq2589x_charger2_driver = {
 	.driver		= {
 		.name	= "bq2589x-2",
 		.of_match_table = bq2589x_charger2_match_table,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#endif
 	},
 
 	.id_table	= bq2589x_charger2_id,
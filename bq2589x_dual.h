@@ -0,0 +1,645 @@
+/*
+ * BQ2589x dual charger driver, state shared with its KUnit suite
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef __BQ2589X_DUAL_H__
+#define __BQ2589X_DUAL_H__
+
+#include <linux/device.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/notifier.h>
+#include <linux/power_supply.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include "bq2589x_reg.h"
+
+struct regulator_dev;
+struct dentry;
+
+enum bq2589x_vbus_type {
+	BQ2589X_VBUS_NONE,
+	BQ2589X_VBUS_USB_SDP,
+	BQ2589X_VBUS_USB_CDP,
+	BQ2589X_VBUS_USB_DCP,
+	BQ2589X_VBUS_MAXC,
+	BQ2589X_VBUS_UNKNOWN,
+	BQ2589X_VBUS_NONSTAND,
+	BQ2589X_VBUS_OTG,
+	BQ2589X_VBUS_TYPE_NUM,
+};
+
+enum bq2589x_part_no {
+	BQ25890 = 0x03,
+	BQ25892 = 0x00,
+	BQ25895 = 0x07,
+};
+
+#define BQ2589X_FEAT_DPDM		BIT(0)	/* D+/D- input source detection */
+#define BQ2589X_FEAT_HVDCP		BIT(1)	/* HVDCP / MaxCharge detection */
+#define BQ2589X_FEAT_PUMPX		BIT(2)	/* PE+ current pulse signalling */
+#define BQ2589X_FEAT_ICO		BIT(3)
+
+/*
+ * Per part description, selected from REG14 PN at probe. Register
+ * layout, ranges and the ADC are common to the family and stay in
+ * bq2589x_reg.h; the parts only differ in the blocks they carry.
+ */
+struct bq2589x_variant {
+	const char	*name;
+	u8			pn;
+	u32			features;
+};
+
+#define bq2589x_has(bq, feat)	((bq)->variant->features & (feat))
+
+#define BQ2589X_STATUS_PLUGIN		0x0001
+#define BQ2589X_STATUS_PG		0x0002
+#define BQ2589X_STATUS_FAULT		0x0008
+
+#define BQ2589X_STATUS_EXIST		0x0100
+#define BQ2589X_STATUS_CHARGE_ENABLE 0x0200
+
+#define BQ2589X_SHADOW_NUM	(BQ2589X_REG_0D + 1)
+
+/* ADC result registers REG0E-12, in register order */
+enum bq2589x_adc_ch {
+	BQ2589X_CH_BATV,
+	BQ2589X_CH_SYSV,
+	BQ2589X_CH_TSPCT,
+	BQ2589X_CH_VBUSV,
+	BQ2589X_CH_ICHGR,
+	BQ2589X_CH_NUM,
+};
+#define BQ2589X_ADC_ALL		(BIT(BQ2589X_CH_NUM) - 1)
+
+#define BQ2589X_ADC_WIN_MAX	7
+
+struct bq2589x_adc_filter {
+	int		win[BQ2589X_ADC_WIN_MAX];
+	unsigned long stamp[BQ2589X_ADC_WIN_MAX];	/* jiffies */
+	u8		pos;
+	u8		count;
+	bool	held;		/* previous sample was held back as an outlier */
+	int		last;		/* latest accepted sample */
+	int		ewma_acc;	/* scaled by 1 << adc_ewma_shift */
+	bool	ewma_valid;
+};
+
+/* i2c recorder ring and the layout its debugfs dump is read back with */
+#define BQ2589X_TRACE_MAGIC		0x52544251	/* "QBTR" */
+#define BQ2589X_TRACE_VERSION	1
+#define BQ2589X_TRACE_DATA		12	/* covers the REG00-0A block read */
+#define BQ2589X_TRACE_MAX_DEPTH	2048	/* 64KiB of records per chip */
+
+#define BQ2589X_TRACE_WRITE		BIT(0)
+#define BQ2589X_TRACE_ERROR		BIT(1)
+#define BQ2589X_TRACE_CHG2		BIT(2)	/* transaction on charger 2 */
+
+/* work that issued the transaction, BIT(7) set when it is charger 2's */
+enum bq2589x_trace_ctx {
+	BQ2589X_CTX_TASK,	/* probe, sysfs, notifiers, regulator ops */
+	BQ2589X_CTX_INIT,
+	BQ2589X_CTX_IRQ,
+	BQ2589X_CTX_BATT,
+	BQ2589X_CTX_SM,
+	BQ2589X_CTX_MONITOR,
+	BQ2589X_CTX_NOTIFY,
+};
+#define BQ2589X_CTX_CHG2		BIT(7)
+
+struct bq2589x_trace_hdr {
+	__le32	magic;
+	u8		version;
+	u8		rec_size;
+	u8		part_no;
+	u8		primary;
+	__le32	count;		/* records that follow, oldest first */
+	__le32	dropped;	/* overwritten before this dump */
+} __packed;
+
+struct bq2589x_trace_rec {
+	__le64	ts_ns;		/* monotonic */
+	__le32	seq;		/* xfer_count of the chip */
+	u8		reg;
+	u8		len;
+	u8		flags;
+	u8		ctx;
+	u8		state;		/* state machine state when issued */
+	s8		ret;		/* 0 or -errno of the final attempt */
+	u8		data[BQ2589X_TRACE_DATA];
+	u8		pad[2];
+} __packed;
+
+struct bq2589x_trace {
+	spinlock_t	lock;
+	u32			depth;	/* power of two */
+	u32			head;	/* records ever written */
+	struct bq2589x_trace_rec rec[];
+};
+
+struct bq2589x_config {
+	bool	enable_auto_dpdm;
+	bool	enable_12v;
+
+	int		charge_voltage;
+	int		charge_current;
+	int		input_current_limit;	/* mA, fallback once a source contract is gone */
+
+	bool	enable_term;
+	int		term_current;
+
+	bool 	enable_ico;
+	bool	enable_absolute_vindpm;
+
+	bool	i2c_bus_recovery;
+
+	int		eff_sw_loss;	/* fixed switching + quiescent loss, mW */
+	int		eff_res;		/* equivalent conduction resistance, mOhm */
+
+	u32		adc_window;		/* samples a stable reading is the median of */
+	u32		adc_sample_ms;	/* spacing of those samples, the conversion period */
+	u32		adc_ewma_shift;	/* telemetry smoothing, weight 1/2^shift */
+};
+
+
+struct bq2589x {
+	struct device *dev;
+	struct i2c_client *client;
+
+	enum   bq2589x_part_no part_no;
+	const struct bq2589x_variant *variant;
+	int    revision;
+
+	unsigned int    status;
+	int		vbus_type;
+
+	bool	primary;	/* charger 1, owns detection and policy */
+	bool	enabled;
+	bool	otg_active;	/* sourcing VBUS, charge side suspended */
+
+	bool    interrupt;
+	ktime_t irq_time;
+
+	u32     xfer_count;	/* i2c transactions issued on this chip */
+	u32     i2c_errors;	/* failed attempts, retried or not */
+	u32     i2c_retried;	/* transfers that succeeded on a retry */
+	u32     i2c_failures;	/* transfers given up on */
+	u32     i2c_recoveries;	/* bus recoveries issued */
+
+	struct bq2589x_trace *trace;	/* i2c recorder, NULL unless trace_depth set */
+	struct dentry *debug_dir;
+
+	u8      chrg_stat;	/* REG0B CHRG_STAT as last seen, served to get_property */
+
+	int     ichg_req;	/* ICHG policy asked for, before JEITA derating */
+	int     vreg_req;
+	int     iinlim_req;	/* before the userspace ceiling */
+
+	struct delayed_work notify_work;
+	unsigned long notify_pending;
+	unsigned long notify_last;	/* jiffies of the last notification burst */
+
+	u8      shadow[BQ2589X_SHADOW_NUM];	/* intended REG00-0A, 0D */
+	bool    shadow_loaded;
+	struct mutex reg_lock;	/* serializes register access, see bq2589x_stage_begin() */
+	struct task_struct *stager;	/* holds reg_lock, its writes land in the shadow */
+	bool    warm;		/* found configured by a previous driver instance */
+
+	int     vbus_volt;
+	int     vbat_volt;
+
+	struct bq2589x_adc_filter adc[BQ2589X_CH_NUM];
+	u32     adc_outliers;	/* samples dropped by the filter */
+	u32     adc_period_ms;	/* spacing of the samples currently taken */
+
+	int     rsoc;
+	struct	bq2589x_config	cfg;
+	struct work_struct init_work;
+	struct work_struct irq_work;
+	struct delayed_work sm_work;
+	struct delayed_work monitor_work;
+	struct delayed_work limits_work;
+
+
+
+	struct power_supply usb;
+	struct power_supply wall;
+	struct power_supply *batt_psy;
+	struct device *batt_dev;	/* holds the lookup's reference */
+	struct notifier_block psy_nb;
+	struct work_struct batt_work;
+	bool	batt_valid;		/* gauge has reported at least once */
+	int		batt_capacity;	/* cached from gauge change events */
+	int		batt_volt;
+	bool	batt_temp_valid;
+	int		batt_temp;		/* 0.1C */
+
+	struct regulator_dev *otg_rdev;
+
+	struct notifier_block source_nb;
+	int		src_volt;	/* contract from Type-C/PD, 0: unknown */
+	int		src_curr;	/* both set from the notifier, READ_ONCE() them */
+
+#if IS_ENABLED(CONFIG_BQ2589X_DUAL_KUNIT_TEST)
+	/* stands in for the bus when set, see bq2589x_dual_test.c */
+	int     (*test_xfer)(struct bq2589x *bq, u8 reg, u8 *data, u8 len, bool write);
+	void    *test_priv;
+#endif
+};
+
+struct pe_ctrl {
+	bool enable;
+	bool tune_up_volt;
+	bool tune_down_volt;
+	bool tune_done;
+	bool tune_fail;
+	int  tune_count;
+	int  target_volt;
+	int	 high_volt_level;/* vbus volt > this threshold means tune up successfully */
+	int  low_volt_level; /* vbus volt < this threshold means tune down successfully */
+	int  vbat_min_volt;  /* to tune up voltage only when vbat > this threshold */
+	int  high_volt_12v_level; /* vbus volt > this threshold means 12v step up succeeded */
+	bool at_12v;
+	bool rollback_12v;   /* 12v sagged this session, stay at 9v */
+};
+
+/* milestones of the plug-in to full-rate bring up chain */
+enum bq2589x_bringup_mark {
+	BQ2589X_MARK_ADAPTER_IN,
+	BQ2589X_MARK_PE_CHECK,
+	BQ2589X_MARK_PE_TUNED,
+	BQ2589X_MARK_ICO_DONE,
+	BQ2589X_MARK_CHG2_ENABLE,
+	BQ2589X_MARK_NUM,
+};
+
+/* adapter classes, vbus_type plus DCP that answered PE+ */
+#define BQ2589X_BRINGUP_CLASS_PE	BQ2589X_VBUS_TYPE_NUM
+#define BQ2589X_BRINGUP_CLASS_NUM	(BQ2589X_VBUS_TYPE_NUM + 1)
+
+#define BQ2589X_BRINGUP_HISTORY	16
+
+struct bq2589x_bringup_hist {
+	int count;
+	int head;
+	int mark_ms[BQ2589X_BRINGUP_HISTORY][BQ2589X_MARK_NUM]; /* -1: not reached */
+	int e2e_ms[BQ2589X_BRINGUP_HISTORY];
+	int xfers[BQ2589X_BRINGUP_HISTORY];
+};
+
+struct bringup_ctrl {
+	bool	active;
+	ktime_t t_plug;
+	u32		xfer_base;
+	int		mark_ms[BQ2589X_MARK_NUM];
+	struct	bq2589x_bringup_hist hist[BQ2589X_BRINGUP_CLASS_NUM];
+};
+
+/* charger 2 engagement: hysteresis on entry, current taper on exit */
+struct chg2_ctrl {
+	int  exit_soc;       /* leave dual charging at or above this rsoc */
+	int  soc_hyst;       /* re-engage only below exit_soc - soc_hyst */
+	int  cv_margin;      /* vbat within this of VREG means CV phase */
+	int  vbat_hyst;      /* re-engage only below VREG - vbat_hyst */
+	int  exit_current;   /* combined ICHG below this, one charger is enough */
+	int  taper_step;     /* charger 2 ICHG decrement per monitor cycle */
+	int  taper_min;      /* HiZ once charger 2 ICHG would drop below this */
+	int  ichg;           /* charger 2 ICHG currently programmed */
+	bool tapering;
+};
+
+/*
+ * Step charging: DT rows of <vbat-max temp-min temp-max ichg vreg>, VBAT
+ * in mV (0: no bound), temperature in 0.1C, ICHG the total of both
+ * chargers in mA. Rows are tried in order, the first one VBAT is below
+ * and the battery temperature is inside of applies. No match suspends
+ * charging.
+ */
+#define BQ2589X_STEP_MAX	8
+#define BQ2589X_STEP_CELLS	5
+
+struct bq2589x_step_row {
+	int		vbat_max;
+	int		temp_min;
+	int		temp_max;
+	int		ichg;
+	int		vreg;
+};
+
+struct step_ctrl {
+	struct bq2589x_step_row rows[BQ2589X_STEP_MAX];
+	int		num;		/* 0: single setpoint from charge-current/voltage */
+	int		hyst;		/* VBAT drop needed to return to an earlier row */
+	bool	valid;		/* stage evaluated this session */
+	int		stage;		/* row in effect, -1 none (suspended) */
+	int		total;		/* ICHG of the stage, both chargers */
+	int		vreg;
+	int		ichg1;		/* charger 1 ICHG as programmed */
+	int		vreg1;		/* VREG as programmed */
+};
+
+/*
+ * Battery NTC as seen on TS: DT pairs of <TS milli-percent, 0.1C>,
+ * ordered cold to hot, so TS% is falling. Interpolated in between and
+ * clamped at the ends.
+ */
+#define BQ2589X_NTC_MAX		16
+
+struct ntc_ctrl {
+	int		num;
+	int		mpct[BQ2589X_NTC_MAX];
+	int		temp[BQ2589X_NTC_MAX];
+};
+
+/*
+ * Software JEITA: DT rows of <temp-min temp-max ichg-permille vreg-drop>
+ * in 0.1C, permille of the requested ICHG and mV off the requested
+ * VREG, applied to both chargers. Outside every zone charging stops.
+ * Zones are left only hysteresis past their edge.
+ */
+#define BQ2589X_JEITA_MAX	6
+
+struct bq2589x_jeita_zone {
+	int		temp_min;
+	int		temp_max;
+	int		ichg_pm;
+	int		vreg_drop;
+};
+
+struct jeita_ctrl {
+	struct bq2589x_jeita_zone zones[BQ2589X_JEITA_MAX];
+	int		num;
+	int		hyst;
+	int		zone;		/* -1: outside all zones */
+	int		ichg_pm;	/* in effect, 1000 when temperature is unknown */
+	int		vreg_drop;
+};
+
+/*
+ * Ceilings written by userspace through the supply properties, -1 when
+ * unset. ICHG and IINLIM bound the pair: charger 2 gets its efficiency
+ * share, charger 1 the rest. VREG bounds both chargers.
+ */
+#define BQ2589X_LIMITS_BATCH_MS	50	/* writes landing within this go out together */
+
+struct limits_ctrl {
+	int		ichg;		/* mA, both chargers */
+	int		iinlim;		/* mA, both chargers */
+	int		vreg;		/* mV */
+};
+
+/* what a previously seen adapter settled at, to skip re-tuning on replug */
+#define BQ2589X_ADAPTER_CACHE_SIZE	8
+#define BQ2589X_ADAPTER_VBUS_TOL	150	/* idle vbus match window, mV */
+
+struct bq2589x_adapter_entry {
+	bool	valid;
+	int		vbus_type;
+	int		idle_vbus;	/* mV before any tuning */
+	int		pe_volt;	/* PE+ target reached, 0: stays at 5v */
+	int		ico_ma;		/* ICO result on charger 1 */
+	u32		hits;
+	u32		last_used;	/* LRU stamp */
+};
+
+struct adapter_cache {
+	u32		seq;
+	struct	bq2589x_adapter_entry entry[BQ2589X_ADAPTER_CACHE_SIZE];
+};
+
+/*
+ * Charging session state machine. All bring up steps run from one
+ * delayed work, sm_work: a state handler performs one step and returns
+ * the next state plus how long to wait before running it. Plug, unplug
+ * and policy requests are posted as events and processed between steps,
+ * so an unplug aborts whatever tuning is in flight at the next wakeup
+ * and nothing from the old session survives into the next one.
+ */
+enum bq2589x_sm_state {
+	BQ2589X_SM_IDLE,
+	BQ2589X_SM_ADAPTER_IN,
+	BQ2589X_SM_WARM_START,
+	BQ2589X_SM_VINDPM_SETTLE,
+	BQ2589X_SM_PE_CHECK,
+	BQ2589X_SM_PE_TUNE,
+	BQ2589X_SM_PE_PUMP_WAIT,
+	BQ2589X_SM_PE_SETTLED,
+	BQ2589X_SM_PE_FAILED,
+	BQ2589X_SM_ICO,
+	BQ2589X_SM_ICO_WAIT,
+	BQ2589X_SM_CACHE_APPLY,
+	BQ2589X_SM_CACHE_VERIFY,
+	BQ2589X_SM_CHG2_ENABLE,
+	BQ2589X_SM_CHARGING,
+	BQ2589X_SM_NUM,
+};
+
+#define BQ2589X_EV_PLUG_IN		BIT(0)
+#define BQ2589X_EV_PLUG_OUT		BIT(1)
+#define BQ2589X_EV_SOURCE_CAP	BIT(2)
+#define BQ2589X_EV_RERUN_ICO	BIT(3)
+#define BQ2589X_EV_PE_TUNE_DOWN	BIT(4)
+#define BQ2589X_EV_PE_ROLLBACK	BIT(5)
+#define BQ2589X_EV_WARM			BIT(6)	/* with PLUG_IN: chips kept their state */
+
+/* events that only make sense once the bring up has finished */
+#define BQ2589X_EV_STEADY	(BQ2589X_EV_RERUN_ICO | BQ2589X_EV_PE_TUNE_DOWN | BQ2589X_EV_PE_ROLLBACK)
+
+#define BQ2589X_VINDPM_SETTLE_MS	1000
+#define BQ2589X_MONITOR_MS			10000
+
+struct sm_ctrl {
+	int		state;
+	int		settle_next;	/* state to enter once VINDPM has settled */
+	unsigned long due;		/* jiffies at which the state handler runs */
+	unsigned long events;	/* posted, not yet consumed */
+	u32		session;
+	u32		xfer_base;
+	u32		wakeups;		/* sm_work runs this session */
+	u32		transitions;	/* state changes this session */
+	u32		peak_xfers;		/* most i2c transactions in one sm_work run this session */
+	struct task_struct *task;	/* running sm_work, its transfers are counted */
+	u32		run_xfers;
+	int		idle_vbus;		/* adapter fingerprint, sampled on plug in */
+	bool	pe_tried;
+	bool	pe_skipped;		/* cached PE+ voltage not used, battery not eligible */
+	bool	adopted;		/* charger 2 found running mid bring up, not engaged by us */
+	int		ico_ma;			/* last ICO result this session, 0: none */
+	int		cache_hit;		/* adapter cache entry in use, -1: none */
+	struct	bq2589x_adapter_entry cached;
+};
+
+/* input power tracking from the DPM status bits */
+struct dpm_ctrl {
+	int  step;           /* IINLIM nudge per monitor cycle, mA */
+	int  max_iinlim;     /* never probe above this, mA */
+	int  vbus_shift;     /* VBUS move that counts as a source change, mV */
+	int  vdpm_rerun;     /* consecutive VDPM cycles before re-running ICO */
+	int  vbus_ref;       /* VBUS when ICO last ran, 0: not sampled */
+	int  vdpm_cycles;
+	int  ceiling[2];     /* per charger IINLIM that last collapsed VBUS, 0: none */
+};
+
+/*
+ * Pack and trace resistance, estimated from the VBAT step across the
+ * current steps policy makes itself, feeds BAT_COMP/VCLAMP.
+ */
+#define BQ2589X_IR_MIN_DELTA	400		/* mA step worth measuring across */
+#define BQ2589X_IR_MAX_SANE		300		/* mOhm, above this the sample is noise */
+#define BQ2589X_IR_MIN_SAMPLES	3
+
+struct ir_ctrl {
+	int  max_comp;       /* BAT_COMP ceiling, mOhm, 0: leave IR compensation off */
+	int  max_clamp;      /* VCLAMP ceiling, mV */
+	bool expect;         /* policy stepped ICHG since the last sample */
+	int  vbat;           /* previous monitor sample */
+	int  ichg;
+	int  est;            /* mOhm, filtered */
+	int  samples;
+	int  comp;           /* as programmed */
+	int  clamp;
+};
+
+/* per session energy accounting, sampled by the monitor */
+enum bq2589x_acct_phase {
+	BQ2589X_PHASE_5V_SINGLE,
+	BQ2589X_PHASE_BOOSTED,	/* vbus raised by PE+/HVDCP/PD, charger 1 only */
+	BQ2589X_PHASE_DUAL,
+	BQ2589X_PHASE_TAPER,
+	BQ2589X_PHASE_DONE,
+	BQ2589X_PHASE_NUM,
+};
+
+struct acct_ctrl {
+	ktime_t last;			/* 0: no sample yet this session */
+	u64		charge[2];		/* mA * ms, per charger */
+	u64		energy[2];		/* mV * mA * ms, per charger */
+	u64		phase_ms[BQ2589X_PHASE_NUM];
+	u64		total_ms;
+	int		peak_mw;
+};
+
+/* source capability pushed by an external Type-C/PD port controller */
+struct bq2589x_source_cap {
+	int volt;	/* mV, 0 when the contract is gone */
+	int curr;	/* mA */
+};
+
+/*
+ * Register field <-> physical value conversion. Encoding clamps to the
+ * range the field can represent, so an out of range request saturates
+ * instead of wrapping into neighbouring bits.
+ */
+static inline u8 bq2589x_field_encode(int val, int base, int lsb, u8 mask, u8 shift)
+{
+	int max = mask >> shift;
+	int code;
+
+	if (val < base)
+		val = base;
+	code = (val - base) / lsb;
+	if (code > max)
+		code = max;
+
+	return (u8)(code << shift);
+}
+
+static inline int bq2589x_field_decode(u8 reg, int base, int lsb, u8 mask, u8 shift)
+{
+	return base + ((reg & mask) >> shift) * lsb;
+}
+
+#define BQ2589X_ENCODE(val, field) \
+	bq2589x_field_encode(val, BQ2589X_##field##_BASE, BQ2589X_##field##_LSB, \
+			BQ2589X_##field##_MASK, BQ2589X_##field##_SHIFT)
+#define BQ2589X_DECODE(reg, field) \
+	bq2589x_field_decode(reg, BQ2589X_##field##_BASE, BQ2589X_##field##_LSB, \
+			BQ2589X_##field##_MASK, BQ2589X_##field##_SHIFT)
+
+int bq2589x_notify_source_cap(int volt, int curr);
+int bq2589x_adc_start(struct bq2589x *bq, bool oneshot);
+int bq2589x_adc_stop(struct bq2589x *bq);
+int bq2589x_adc_read_battery_volt(struct bq2589x *bq);
+int bq2589x_adc_read_sys_volt(struct bq2589x *bq);
+int bq2589x_adc_read_vbus_volt(struct bq2589x *bq);
+int bq2589x_adc_read_temperature(struct bq2589x *bq);
+int bq2589x_adc_read_batt_temp(struct bq2589x *bq, int *temp);
+int bq2589x_adc_read_charge_current(struct bq2589x *bq);
+int bq2589x_set_chargecurrent(struct bq2589x *bq, int curr);
+int bq2589x_set_term_current(struct bq2589x *bq, int curr);
+int bq2589x_set_prechg_current(struct bq2589x *bq, int curr);
+int bq2589x_set_chargevoltage(struct bq2589x *bq, int volt);
+int bq2589x_set_ir_comp(struct bq2589x *bq, int mohm, int clamp);
+int bq2589x_set_input_volt_limit(struct bq2589x *bq, int volt);
+int bq2589x_set_input_current_limit(struct bq2589x *bq, int curr);
+int bq2589x_set_vindpm_offset(struct bq2589x *bq, int offset);
+void bq2589x_start_charging(struct bq2589x *bq);
+void bq2589x_stop_charging(struct bq2589x *bq);
+int bq2589x_get_charging_status(struct bq2589x *bq);
+void bq2589x_set_otg(struct bq2589x *bq, int enable);
+int bq2589x_set_watchdog_timer(struct bq2589x *bq, u8 timeout);
+int bq2589x_disable_watchdog_timer(struct bq2589x *bq);
+int bq2589x_reset_watchdog_timer(struct bq2589x *bq);
+int bq2589x_force_dpdm(struct bq2589x *bq);
+int bq2589x_reset_chip(struct bq2589x *bq);
+int bq2589x_enter_ship_mode(struct bq2589x *bq);
+int bq2589x_enter_hiz_mode(struct bq2589x *bq);
+int bq2589x_exit_hiz_mode(struct bq2589x *bq);
+int bq2589x_get_hiz_mode(struct bq2589x *bq, u8 *state);
+int bq2589x_enable_ilim_pin(struct bq2589x *bq);
+int bq2589x_disable_ilim_pin(struct bq2589x *bq);
+int bq2589x_pumpx_enable(struct bq2589x *bq, int enable);
+int bq2589x_pumpx_increase_volt(struct bq2589x *bq);
+int bq2589x_pumpx_increase_volt_done(struct bq2589x *bq);
+int bq2589x_pumpx_decrease_volt(struct bq2589x *bq);
+int bq2589x_pumpx_decrease_volt_done(struct bq2589x *bq);
+
+/*
+ * The KUnit suite is a separate object. Internals it drives are static
+ * in the driver unless the suite is built, and the driver's globals
+ * reach it through bq2589x_test_state rather than as global symbols.
+ */
+#if IS_ENABLED(CONFIG_BQ2589X_DUAL_KUNIT_TEST)
+#define BQ2589X_VISIBLE
+
+struct bq2589x_test_state {
+	struct bq2589x		**bq1;
+	struct bq2589x		**bq2;
+	struct pe_ctrl		*pe;
+	struct sm_ctrl		*sm;
+	struct chg2_ctrl	*chg2;
+	struct bringup_ctrl	*bringup;
+	struct step_ctrl	*step;
+	struct jeita_ctrl	*jeita;
+	struct dpm_ctrl		*dpm;
+	struct ir_ctrl		*ir;
+	struct acct_ctrl	*acct;
+	struct adapter_cache *acache;
+	s64					*skew_ms;	/* added to bring up timestamps */
+};
+
+extern const struct bq2589x_test_state bq2589x_test_state;
+
+int bq2589x_detect_device(struct bq2589x *bq);
+int bq2589x_init_device(struct bq2589x *bq);
+int bq2589x_shadow_load(struct bq2589x *bq);
+int bq2589x_shadow_apply(struct bq2589x *bq);
+void bq2589x_stage_begin(struct bq2589x *bq);
+int bq2589x_stage_end(struct bq2589x *bq, bool apply);
+irqreturn_t bq2589x_charger1_interrupt(int irq, void *data);
+void bq2589x_charger1_irq_workfunc(struct work_struct *work);
+void bq2589x_sm_workfunc(struct work_struct *work);
+void bq2589x_monitor_workfunc(struct work_struct *work);
+ssize_t bq2589x_show_bringup_stats(struct device *dev,
+				struct device_attribute *attr, char *buf);
+#else
+#define BQ2589X_VISIBLE	static
+#endif
+
+#endif
@@ -0,0 +1,1268 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * KUnit tests for the BQ2589x dual charger driver. The driver runs
+ * unmodified against a register level model of the charger pair and
+ * the adapter on VBUS, standing in for the bus through bq->test_xfer.
+ * Time is simulated: the state machine and the monitor are run from
+ * the test, and a wait the driver asks for is skipped over instead of
+ * slept through, so a full PE+ bring up takes milliseconds.
+ */
+
+#include <kunit/test.h>
+#include <linux/jiffies.h>
+#include <linux/random.h>
+#include <linux/sort.h>
+#include <linux/workqueue.h>
+#include "bq2589x_dual.h"
+
+#define SIM_NUM_REGS	(BQ2589X_REG_14 + 1)
+#define SIM_XFER_BUDGET	128	/* where sm_work warns about one run */
+
+static const struct bq2589x_test_state *const st = &bq2589x_test_state;
+
+/* what the adapter on VBUS does, vbus_type as charger 1 would detect it */
+struct sim_adapter {
+	int		vbus_type;
+	int		idle_mv;	/* VBUS before any PE+ pulse */
+	int		max_ma;		/* what ICO finds */
+	bool	pe;			/* answers PE+ current pulses */
+	int		pe_max_mv;
+	int		pump_ms;	/* a pulse train until VBUS has moved */
+};
+
+static const struct sim_adapter sim_sdp = {
+	.vbus_type = BQ2589X_VBUS_USB_SDP, .idle_mv = 5000, .max_ma = 500,
+};
+static const struct sim_adapter sim_dcp = {
+	.vbus_type = BQ2589X_VBUS_USB_DCP, .idle_mv = 5000, .max_ma = 2000, .pump_ms = 2500,
+};
+static const struct sim_adapter sim_pe = {
+	.vbus_type = BQ2589X_VBUS_USB_DCP, .idle_mv = 5000, .max_ma = 2000,
+	.pe = true, .pe_max_mv = 9000, .pump_ms = 2500,
+};
+static const struct sim_adapter sim_hvdcp = {
+	.vbus_type = BQ2589X_VBUS_MAXC, .idle_mv = 9000, .max_ma = 2000,
+};
+static const struct sim_adapter sim_nonstand = {
+	.vbus_type = BQ2589X_VBUS_NONSTAND, .idle_mv = 5000, .max_ma = 1000,
+};
+
+struct sim_chip {
+	u8		regs[SIM_NUM_REGS];
+	u8		fault;		/* REG0C latch, cleared by reading it */
+	int		pump_dir;	/* +1/-1 while a pulse train is out */
+	int		pump_end;	/* sim time it completes at */
+};
+
+struct sim {
+	struct bq2589x	*bq[2];
+	struct sim_chip	chip[2];
+	const struct sim_adapter *adapter;	/* NULL: unplugged */
+	int		vbus_mv;
+	int		vbat_mv;
+	int		now_ms;
+	int		fail_next;	/* transfers to fail from now on */
+	int		fail_pm;	/* then fail this many per mille at random */
+	bool	fuzz;		/* status and ADC registers read back random */
+	struct rnd_state rnd;
+	const struct bq2589x_trace *replay[2];	/* answer from a recording instead */
+	u32		replay_pos[2];
+	int		diverged;	/* transactions the recording doesn't have */
+};
+
+static const struct bq2589x_config sim_cfg[2] = {
+	{
+		.enable_auto_dpdm = true,
+		.charge_voltage = 4208,
+		.charge_current = 2048,
+		.input_current_limit = 500,
+		.enable_term = true,
+		.term_current = 256,
+		.enable_ico = true,
+		.enable_absolute_vindpm = true,
+		.eff_sw_loss = 150,
+		.eff_res = 60,
+		.adc_window = 3,
+		.adc_sample_ms = 1000,
+		.adc_ewma_shift = 2,
+	},
+	{
+		.charge_voltage = 4208,
+		.charge_current = 2048,
+		.input_current_limit = 500,
+		.enable_term = true,
+		.term_current = 512,
+		.enable_absolute_vindpm = true,
+		.eff_sw_loss = 150,
+		.eff_res = 60,
+		.adc_window = 3,
+		.adc_sample_ms = 1000,
+		.adc_ewma_shift = 2,
+	},
+};
+
+/* the globals as a fresh boot has them, every case starts from these */
+static struct pe_ctrl		saved_pe;
+static struct sm_ctrl		saved_sm;
+static struct chg2_ctrl		saved_chg2;
+static struct bringup_ctrl	saved_bringup;
+static struct step_ctrl		saved_step;
+static struct jeita_ctrl	saved_jeita;
+static struct dpm_ctrl		saved_dpm;
+static struct ir_ctrl		saved_ir;
+static struct acct_ctrl		saved_acct;
+static struct adapter_cache	saved_acache;
+static bool saved;
+
+static void sim_chip_por(struct sim_chip *c, u8 pn)
+{
+	memset(c->regs, 0, sizeof(c->regs));
+	c->regs[BQ2589X_REG_00] = BQ2589X_ENILIM_MASK | BQ2589X_ENCODE(500, IINLIM);
+	c->regs[BQ2589X_REG_01] = 0x05;
+	c->regs[BQ2589X_REG_02] = 0x1D;
+	c->regs[BQ2589X_REG_03] = 0x1A;
+	c->regs[BQ2589X_REG_04] = 0x20;
+	c->regs[BQ2589X_REG_05] = 0x13;
+	c->regs[BQ2589X_REG_06] = 0x5E;
+	c->regs[BQ2589X_REG_07] = 0x9D;
+	c->regs[BQ2589X_REG_08] = 0x03;
+	c->regs[BQ2589X_REG_09] = 0x44;
+	c->regs[BQ2589X_REG_0A] = 0x73;
+	c->regs[BQ2589X_REG_0D] = 0x12;
+	c->regs[BQ2589X_REG_14] = pn << BQ2589X_PN_SHIFT;
+	c->pump_dir = 0;
+}
+
+static bool sim_charging(struct sim_chip *c)
+{
+	return (c->regs[BQ2589X_REG_03] & BQ2589X_CHG_CONFIG_MASK)
+		&& !(c->regs[BQ2589X_REG_00] & BQ2589X_ENHIZ_MASK);
+}
+
+/* finish pulse trains that are due, VBUS only moves if the adapter answers */
+static void sim_tick(struct sim *sim)
+{
+	const struct sim_adapter *a = sim->adapter;
+	struct sim_chip *c = &sim->chip[0];
+
+	if (!c->pump_dir || sim->now_ms < c->pump_end)
+		return;
+
+	c->regs[BQ2589X_REG_09] &= ~(BQ2589X_PUMPX_UP_MASK | BQ2589X_PUMPX_DOWN_MASK);
+	if (a && a->pe)
+		sim->vbus_mv = clamp(sim->vbus_mv + c->pump_dir * 1000, a->idle_mv, a->pe_max_mv);
+	c->pump_dir = 0;
+}
+
+static u8 sim_read(struct sim *sim, struct sim_chip *c, u8 reg)
+{
+	const struct sim_adapter *a = sim->adapter;
+	int iinlim, ichg;
+	u8 val;
+
+	if (sim->fuzz && reg >= BQ2589X_REG_0B && reg != BQ2589X_REG_0D)
+		return prandom_u32_state(&sim->rnd);
+
+	switch (reg) {
+	case BQ2589X_REG_0B:
+		if (!a)
+			return 0;
+		val = (a->vbus_type << BQ2589X_VBUS_STAT_SHIFT) | BQ2589X_PG_STAT_MASK;
+		if (sim_charging(c))
+			val |= BQ2589X_CHRG_STAT_FASTCHG << BQ2589X_CHRG_STAT_SHIFT;
+		return val;
+	case BQ2589X_REG_0C:
+		val = c->fault;
+		c->fault = 0;
+		return val;
+	case BQ2589X_REG_0E:
+		return BQ2589X_ENCODE(sim->vbat_mv, BATV);
+	case BQ2589X_REG_0F:
+		return BQ2589X_ENCODE(sim->vbat_mv + 100, SYSV);
+	case BQ2589X_REG_10:
+		return 0x40;
+	case BQ2589X_REG_11:
+		if (!a)
+			return 0;
+		return BQ2589X_VBUS_GD_MASK | BQ2589X_ENCODE(sim->vbus_mv, VBUSV);
+	case BQ2589X_REG_12:
+		if (!a || !sim_charging(c))
+			return 0;
+		iinlim = BQ2589X_DECODE(c->regs[BQ2589X_REG_00], IINLIM);
+		ichg = BQ2589X_DECODE(c->regs[BQ2589X_REG_04], ICHG);
+		return BQ2589X_ENCODE(min(ichg, iinlim * sim->vbus_mv / sim->vbat_mv * 9 / 10), ICHGR);
+	default:
+		return c->regs[reg];
+	}
+}
+
+static void sim_write(struct sim *sim, struct sim_chip *c, u8 reg, u8 val)
+{
+	const struct sim_adapter *a = sim->adapter;
+	int iinlim;
+
+	switch (reg) {
+	case BQ2589X_REG_02:
+		c->regs[reg] = val & ~(BQ2589X_CONV_START_MASK | BQ2589X_FORCE_DPDM_MASK);
+		break;
+	case BQ2589X_REG_03:
+		c->regs[reg] = val & ~BQ2589X_WDT_RESET_MASK;
+		break;
+	case BQ2589X_REG_09:
+		c->regs[reg] = val & ~BQ2589X_FORCE_ICO_MASK;
+		if (val & BQ2589X_FORCE_ICO_MASK) {
+			iinlim = BQ2589X_DECODE(c->regs[BQ2589X_REG_00], IINLIM);
+			c->regs[BQ2589X_REG_13] = BQ2589X_ENCODE(a ? min(iinlim, a->max_ma) : iinlim,
+								IDPM_LIM);
+			c->regs[BQ2589X_REG_14] |= BQ2589X_ICO_OPTIMIZED_MASK;
+		}
+		if ((val & (BQ2589X_PUMPX_UP_MASK | BQ2589X_PUMPX_DOWN_MASK))
+		    && (c->regs[BQ2589X_REG_04] & BQ2589X_EN_PUMPX_MASK) && !c->pump_dir) {
+			c->pump_dir = (val & BQ2589X_PUMPX_UP_MASK) ? 1 : -1;
+			c->pump_end = sim->now_ms + (a ? a->pump_ms : 0);
+		}
+		break;
+	case BQ2589X_REG_14:
+		if (val & BQ2589X_RESET_MASK)
+			sim_chip_por(c, (c->regs[reg] & BQ2589X_PN_MASK) >> BQ2589X_PN_SHIFT);
+		break;
+	case BQ2589X_REG_0B:
+	case BQ2589X_REG_0C:
+	case BQ2589X_REG_0E ... BQ2589X_REG_13:
+		break;
+	default:
+		c->regs[reg] = val;
+		break;
+	}
+}
+
+/*
+ * Next transaction of a recording. Reads return what was recorded,
+ * writes and anything out of order only count as divergence: the
+ * driver is meant to repeat exactly what it did.
+ */
+static int sim_replay(struct sim *sim, int chg, u8 reg, u8 *data, u8 len, bool write)
+{
+	const struct bq2589x_trace *t = sim->replay[chg];
+	const struct bq2589x_trace_rec *r;
+	u8 n = min_t(u8, len, BQ2589X_TRACE_DATA);
+
+	if (sim->replay_pos[chg] == t->head) {
+		sim->diverged++;
+		return -EIO;
+	}
+	r = &t->rec[sim->replay_pos[chg]++ & (t->depth - 1)];
+
+	if (r->reg != reg || r->len != len || !(r->flags & BQ2589X_TRACE_WRITE) != !write
+	    || (write && memcmp(r->data, data, n)))
+		sim->diverged++;
+
+	if (r->ret)
+		return r->ret;
+	if (write)
+		return 0;
+	memcpy(data, r->data, n);
+	return len > 1 ? len : data[0];
+}
+
+static int sim_xfer(struct bq2589x *bq, u8 reg, u8 *data, u8 len, bool write)
+{
+	struct sim *sim = bq->test_priv;
+	struct sim_chip *c = &sim->chip[bq->primary ? 0 : 1];
+	int i;
+
+	if (sim->replay[bq->primary ? 0 : 1])
+		return sim_replay(sim, bq->primary ? 0 : 1, reg, data, len, write);
+
+	if (sim->fail_next) {
+		sim->fail_next--;
+		return -EIO;
+	}
+	if (sim->fail_pm && prandom_u32_state(&sim->rnd) % 1000 < sim->fail_pm)
+		return -EIO;
+	if (reg + len > SIM_NUM_REGS)
+		return -EINVAL;
+
+	sim_tick(sim);
+	for (i = 0; i < len; i++) {
+		if (write)
+			sim_write(sim, c, reg + i, data[i]);
+		else
+			data[i] = sim_read(sim, c, reg + i);
+	}
+
+	if (write)
+		return 0;
+	return len > 1 ? len : data[0];
+}
+
+static void sim_advance(struct sim *sim, int ms)
+{
+	sim->now_ms += ms;
+	*st->skew_ms += ms;
+	sim_tick(sim);
+}
+
+static int sim_wdt(const u8 *regs)
+{
+	return (regs[BQ2589X_REG_07] & BQ2589X_WDT_MASK) >> BQ2589X_WDT_SHIFT;
+}
+
+static u32 sim_xfers(struct sim *sim)
+{
+	return sim->bq[0]->xfer_count + sim->bq[1]->xfer_count;
+}
+
+static u8 sim_reg(struct sim *sim, int chg, u8 reg)
+{
+	return sim->chip[chg].regs[reg];
+}
+
+/* the charger 1 interrupt line, handled to completion */
+static void sim_irq(struct sim *sim)
+{
+	struct bq2589x *bq = sim->bq[0];
+
+	bq2589x_charger1_interrupt(0, bq);
+	cancel_work_sync(&bq->irq_work);
+	bq2589x_charger1_irq_workfunc(&bq->irq_work);
+}
+
+static bool sim_steady(void)
+{
+	return st->sm->state == BQ2589X_SM_IDLE || st->sm->state == BQ2589X_SM_CHARGING;
+}
+
+/*
+ * Run sm_work until the machine rests or reaches stop, at most limit_ms
+ * of simulated time. Returns the simulated time taken.
+ */
+static int sim_run_until(struct sim *sim, int stop, int limit_ms)
+{
+	struct sm_ctrl *sm = st->sm;
+	int spent = 0;
+	int runs = 0;
+	long wait;
+	int ms;
+
+	for (;;) {
+		bq2589x_sm_workfunc(&sim->bq[0]->sm_work.work);
+		if (sm->state == stop || (sim_steady() && !sm->events))
+			break;
+		if (++runs > 1000 || spent >= limit_ms)
+			break;
+
+		wait = (long)(sm->due - jiffies);
+		if (wait > 0) {
+			ms = jiffies_to_msecs(wait);
+			sim_advance(sim, ms);
+			spent += ms;
+			sm->due = jiffies;
+		}
+	}
+
+	return spent;
+}
+
+static int sim_run(struct sim *sim)
+{
+	return sim_run_until(sim, -1, 600 * MSEC_PER_SEC);
+}
+
+static void sim_plug(struct sim *sim, const struct sim_adapter *a)
+{
+	struct sim_chip *c = &sim->chip[0];
+	int iinlim;
+
+	sim->adapter = a;
+	sim->vbus_mv = a->idle_mv;
+
+	/* the input limit charger 1's detection lands on */
+	switch (a->vbus_type) {
+	case BQ2589X_VBUS_USB_SDP:
+		iinlim = 500;
+		break;
+	case BQ2589X_VBUS_MAXC:
+		iinlim = 1500;
+		break;
+	case BQ2589X_VBUS_NONSTAND:
+		iinlim = 2100;
+		break;
+	default:
+		iinlim = 3250;
+		break;
+	}
+	c->regs[BQ2589X_REG_00] = (c->regs[BQ2589X_REG_00] & ~BQ2589X_IINLIM_MASK)
+				| BQ2589X_ENCODE(iinlim, IINLIM);
+	c->regs[BQ2589X_REG_13] = BQ2589X_ENCODE(iinlim, IDPM_LIM);
+
+	sim_irq(sim);
+}
+
+static void sim_unplug(struct sim *sim)
+{
+	sim->adapter = NULL;
+	sim->vbus_mv = 0;
+	/* a pulse train still out is cut short */
+	sim->chip[0].pump_dir = 0;
+	sim->chip[0].regs[BQ2589X_REG_09] &= ~(BQ2589X_PUMPX_UP_MASK | BQ2589X_PUMPX_DOWN_MASK);
+	sim_irq(sim);
+}
+
+/* one monitor period later */
+static void sim_monitor(struct sim *sim)
+{
+	sim_advance(sim, BQ2589X_MONITOR_MS);
+	bq2589x_monitor_workfunc(&sim->bq[0]->monitor_work.work);
+	sim_run(sim);
+}
+
+static void sim_work_nop(struct work_struct *work)
+{
+}
+
+static int sim_add_chip(struct kunit *test, struct sim *sim, int i)
+{
+	struct bq2589x *bq;
+	int ret;
+
+	bq = kunit_kzalloc(test, sizeof(*bq), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, bq);
+
+	bq->primary = !i;
+	bq->cfg = sim_cfg[i];
+	bq->adc_period_ms = bq->cfg.adc_sample_ms;
+	bq->test_xfer = sim_xfer;
+	bq->test_priv = sim;
+	mutex_init(&bq->reg_lock);
+
+	/* queued by the driver, run from the test */
+	INIT_WORK(&bq->init_work, sim_work_nop);
+	INIT_WORK(&bq->irq_work, sim_work_nop);
+	INIT_WORK(&bq->batt_work, sim_work_nop);
+	INIT_DELAYED_WORK(&bq->sm_work, sim_work_nop);
+	INIT_DELAYED_WORK(&bq->notify_work, sim_work_nop);
+	INIT_DELAYED_WORK(&bq->monitor_work, sim_work_nop);
+	INIT_DELAYED_WORK(&bq->limits_work, sim_work_nop);
+
+	sim_chip_por(&sim->chip[i], i ? BQ25892 : BQ25890);
+	sim->bq[i] = bq;
+
+	ret = bq2589x_detect_device(bq);
+	if (!ret)
+		ret = bq2589x_init_device(bq);
+	return ret;
+}
+
+/* the globals back to boot, a fresh chip pair published in them */
+static struct sim *sim_new(struct kunit *test)
+{
+	struct sim *sim;
+
+	if (!saved) {
+		saved_pe = *st->pe;
+		saved_sm = *st->sm;
+		saved_chg2 = *st->chg2;
+		saved_bringup = *st->bringup;
+		saved_step = *st->step;
+		saved_jeita = *st->jeita;
+		saved_dpm = *st->dpm;
+		saved_ir = *st->ir;
+		saved_acct = *st->acct;
+		saved_acache = *st->acache;
+		saved = true;
+	}
+	*st->pe = saved_pe;
+	*st->sm = saved_sm;
+	*st->chg2 = saved_chg2;
+	*st->bringup = saved_bringup;
+	*st->step = saved_step;
+	*st->jeita = saved_jeita;
+	*st->dpm = saved_dpm;
+	*st->ir = saved_ir;
+	*st->acct = saved_acct;
+	*st->acache = saved_acache;
+	*st->skew_ms = 0;
+
+	sim = kunit_kzalloc(test, sizeof(*sim), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, sim);
+	sim->vbat_mv = 3700;
+	prandom_seed_state(&sim->rnd, 0x2589);
+	test->priv = sim;	/* the one bq2589x_test_exit() cleans up */
+
+	KUNIT_ASSERT_EQ(test, sim_add_chip(test, sim, 0), 0);
+	KUNIT_ASSERT_EQ(test, sim_add_chip(test, sim, 1), 0);
+	*st->bq1 = sim->bq[0];
+	*st->bq2 = sim->bq[1];
+
+	/* as parsed from the reference dtsi, the gauge has reported */
+	st->pe->enable = true;
+	st->pe->high_volt_level = 8700;
+	st->pe->low_volt_level = 5500;
+	st->pe->vbat_min_volt = 3000;
+	st->pe->high_volt_12v_level = 11500;
+	sim->bq[0]->batt_valid = true;
+	sim->bq[0]->batt_capacity = 50;
+
+	return sim;
+}
+
+static int bq2589x_test_init(struct kunit *test)
+{
+	if (*st->bq1 || *st->bq2)
+		kunit_skip(test, "driver bound to real chargers");
+
+	sim_new(test);
+	return 0;
+}
+
+static void bq2589x_test_exit(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+	int i;
+
+	*st->bq1 = NULL;
+	*st->bq2 = NULL;
+	if (!sim)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(sim->bq); i++) {
+		if (!sim->bq[i])
+			continue;
+		cancel_work_sync(&sim->bq[i]->init_work);
+		cancel_work_sync(&sim->bq[i]->irq_work);
+		cancel_work_sync(&sim->bq[i]->batt_work);
+		cancel_delayed_work_sync(&sim->bq[i]->sm_work);
+		cancel_delayed_work_sync(&sim->bq[i]->notify_work);
+		cancel_delayed_work_sync(&sim->bq[i]->monitor_work);
+		cancel_delayed_work_sync(&sim->bq[i]->limits_work);
+	}
+}
+
+static void bq2589x_test_encode_clamps(struct kunit *test)
+{
+	/* below the field's offset saturates to code 0 */
+	KUNIT_EXPECT_EQ(test, BQ2589X_ENCODE(0, VREG), 0);
+	KUNIT_EXPECT_EQ(test, BQ2589X_ENCODE(50, IINLIM), 0);
+	/* above its range saturates to the all ones code, never spills */
+	KUNIT_EXPECT_EQ(test, BQ2589X_ENCODE(100000, ICHG), BQ2589X_ICHG_MASK);
+	KUNIT_EXPECT_EQ(test, BQ2589X_ENCODE(100000, VREG), BQ2589X_VREG_MASK);
+	KUNIT_EXPECT_EQ(test, BQ2589X_ENCODE(100000, VINDPM), BQ2589X_VINDPM_MASK);
+	KUNIT_EXPECT_EQ(test, BQ2589X_ENCODE(1000, WDT), BQ2589X_WDT_MASK);
+	/* in between rounds down to the step below */
+	KUNIT_EXPECT_EQ(test, BQ2589X_ENCODE(2047, ICHG), 31);
+	KUNIT_EXPECT_EQ(test, BQ2589X_ENCODE(4351, VREG), 31 << BQ2589X_VREG_SHIFT);
+}
+
+static void bq2589x_test_encode_decode(struct kunit *test)
+{
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(BQ2589X_ENCODE(2048, ICHG), ICHG), 2048);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(BQ2589X_ENCODE(4352, VREG), VREG), 4352);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(BQ2589X_ENCODE(1500, IINLIM), IINLIM), 1500);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(BQ2589X_ENCODE(4400, VINDPM), VINDPM), 4400);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(BQ2589X_ENCODE(600, VINDPMOS), VINDPMOS), 600);
+
+	KUNIT_EXPECT_EQ(test, BQ2589X_ENCODE(40, WDT), BQ2589X_WDT_40S << BQ2589X_WDT_SHIFT);
+	KUNIT_EXPECT_EQ(test, BQ2589X_ENCODE(160, WDT), BQ2589X_WDT_160S << BQ2589X_WDT_SHIFT);
+}
+
+static void bq2589x_test_setters_clamp(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+	struct bq2589x *bq = sim->bq[0];
+
+	KUNIT_ASSERT_EQ(test, bq2589x_set_chargecurrent(bq, 100000), 0);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(sim_reg(sim, 0, BQ2589X_REG_04), ICHG),
+			BQ2589X_ICHG_MAX);
+
+	KUNIT_ASSERT_EQ(test, bq2589x_set_input_current_limit(bq, 100000), 0);
+	KUNIT_EXPECT_LE(test, BQ2589X_DECODE(sim_reg(sim, 0, BQ2589X_REG_00), IINLIM),
+			BQ2589X_IINLIM_MAX);
+
+	KUNIT_ASSERT_EQ(test, bq2589x_set_chargevoltage(bq, 100000), 0);
+	KUNIT_EXPECT_LE(test, BQ2589X_DECODE(sim_reg(sim, 0, BQ2589X_REG_06), VREG),
+			BQ2589X_VREG_MAX);
+
+	KUNIT_ASSERT_EQ(test, bq2589x_set_chargevoltage(bq, 0), 0);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(sim_reg(sim, 0, BQ2589X_REG_06), VREG),
+			BQ2589X_VREG_BASE);
+}
+
+static void bq2589x_test_setters_keep_other_bits(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+	struct bq2589x *bq = sim->bq[0];
+	u8 *regs = sim->chip[0].regs;
+
+	regs[BQ2589X_REG_07] = 0xFF;
+	KUNIT_ASSERT_EQ(test, bq2589x_disable_watchdog_timer(bq), 0);
+	KUNIT_EXPECT_EQ(test, regs[BQ2589X_REG_07], 0xFF & ~BQ2589X_WDT_MASK);
+	KUNIT_ASSERT_EQ(test, bq2589x_set_watchdog_timer(bq, 160), 0);
+	KUNIT_EXPECT_EQ(test, regs[BQ2589X_REG_07], 0xFF);
+
+	regs[BQ2589X_REG_06] = 0x03;
+	KUNIT_ASSERT_EQ(test, bq2589x_set_chargevoltage(bq, 4208), 0);
+	KUNIT_EXPECT_EQ(test, regs[BQ2589X_REG_06] & ~BQ2589X_VREG_MASK, 0x03);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(regs[BQ2589X_REG_06], VREG), 4208);
+
+	regs[BQ2589X_REG_08] = 0x03;
+	KUNIT_ASSERT_EQ(test, bq2589x_set_ir_comp(bq, 60, 96), 0);
+	KUNIT_EXPECT_EQ(test, regs[BQ2589X_REG_08] & 0x03, 0x03);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(regs[BQ2589X_REG_08], BAT_COMP), 60);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(regs[BQ2589X_REG_08], VCLAMP), 96);
+}
+
+static void bq2589x_test_staging(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+	struct bq2589x *bq = sim->bq[0];
+	u8 *regs = sim->chip[0].regs;
+	u8 reg04 = regs[BQ2589X_REG_04];
+	u8 reg06 = regs[BQ2589X_REG_06];
+
+	bq2589x_stage_begin(bq);
+	KUNIT_EXPECT_EQ(test, bq2589x_set_chargecurrent(bq, 1024), 0);
+	KUNIT_EXPECT_EQ(test, bq2589x_set_chargevoltage(bq, 4352), 0);
+	/* staged writes reach the shadow only */
+	KUNIT_EXPECT_EQ(test, regs[BQ2589X_REG_04], reg04);
+	KUNIT_EXPECT_EQ(test, regs[BQ2589X_REG_06], reg06);
+	KUNIT_ASSERT_EQ(test, bq2589x_stage_end(bq, true), 0);
+
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(regs[BQ2589X_REG_04], ICHG), 1024);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(regs[BQ2589X_REG_06], VREG), 4352);
+
+	/* a chip reset behind the driver's back is undone from the shadow */
+	sim_chip_por(&sim->chip[0], BQ25890);
+	KUNIT_ASSERT_EQ(test, bq2589x_shadow_apply(bq), 0);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(regs[BQ2589X_REG_04], ICHG), 1024);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(regs[BQ2589X_REG_06], VREG), 4352);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(regs[BQ2589X_REG_01], VINDPMOS), 600);
+}
+
+/* bus transactions per operation, the cost the shadow and block reads are there to cut */
+static void bq2589x_test_xfer_counts(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+	struct bq2589x *bq = sim->bq[0];
+	u32 base;
+
+	base = sim_xfers(sim);
+	KUNIT_ASSERT_EQ(test, bq2589x_set_chargecurrent(bq, 1024), 0);
+	KUNIT_EXPECT_EQ(test, (int)(sim_xfers(sim) - base), 2);
+
+	/* shadow read is REG00-0A plus REG0D, then one write per contiguous run */
+	base = sim_xfers(sim);
+	KUNIT_ASSERT_EQ(test, bq2589x_shadow_apply(bq), 0);
+	KUNIT_EXPECT_EQ(test, (int)(sim_xfers(sim) - base), 2);
+
+	base = sim_xfers(sim);
+	bq2589x_stage_begin(bq);
+	bq2589x_set_chargecurrent(bq, 1536);
+	bq2589x_set_term_current(bq, 128);
+	KUNIT_EXPECT_EQ(test, (int)(sim_xfers(sim) - base), 0);
+	KUNIT_ASSERT_EQ(test, bq2589x_stage_end(bq, true), 0);
+	KUNIT_EXPECT_EQ(test, (int)(sim_xfers(sim) - base), 3);
+
+	base = sim_xfers(sim);
+	bq2589x_stage_begin(bq);
+	bq2589x_set_chargecurrent(bq, 2048);
+	bq2589x_set_chargevoltage(bq, 4352);
+	KUNIT_ASSERT_EQ(test, bq2589x_stage_end(bq, true), 0);
+	KUNIT_EXPECT_EQ(test, (int)(sim_xfers(sim) - base), 4);
+
+	/* REG0B for the detection, then REG0B and REG0C */
+	base = sim_xfers(sim);
+	sim_irq(sim);
+	KUNIT_EXPECT_EQ(test, (int)(sim_xfers(sim) - base), 3);
+
+	/* a whole SDP bring up, the heaviest single run of it stays well inside budget */
+	sim_plug(sim, &sim_sdp);
+	sim_run(sim);
+	KUNIT_ASSERT_EQ(test, st->sm->state, BQ2589X_SM_CHARGING);
+	KUNIT_EXPECT_LE(test, (int)st->sm->peak_xfers, 16);
+
+	/* plugged in the type comes out of that same REG0B */
+	base = sim_xfers(sim);
+	sim_irq(sim);
+	KUNIT_EXPECT_EQ(test, (int)(sim_xfers(sim) - base), 2);
+
+	/*
+	 * A monitor cycle with charger 2 parked: REG07 on both chips, the
+	 * watchdog kick, an ADC block from each, REG0B and charger 1's REG13.
+	 */
+	sim_advance(sim, BQ2589X_MONITOR_MS);
+	base = sim_xfers(sim);
+	bq2589x_monitor_workfunc(&bq->monitor_work.work);
+	KUNIT_EXPECT_EQ(test, (int)(sim_xfers(sim) - base), 8);
+}
+
+/* REG0B and REG0C as the interrupt handler decodes them */
+static void bq2589x_test_irq_status_decode(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+	struct bq2589x *bq = sim->bq[0];
+
+	sim_plug(sim, &sim_sdp);
+	KUNIT_EXPECT_TRUE(test, bq->status & BQ2589X_STATUS_PLUGIN);
+	KUNIT_EXPECT_TRUE(test, bq->status & BQ2589X_STATUS_PG);
+	KUNIT_EXPECT_FALSE(test, bq->status & BQ2589X_STATUS_FAULT);
+	KUNIT_EXPECT_EQ(test, bq->vbus_type, BQ2589X_VBUS_USB_SDP);
+	KUNIT_EXPECT_EQ(test, (int)bq->chrg_stat, BQ2589X_CHRG_STAT_FASTCHG);
+	KUNIT_EXPECT_TRUE(test, st->sm->events & BQ2589X_EV_PLUG_IN);
+	sim_run(sim);
+
+	/* a fault is latched until the next interrupt reads REG0C again */
+	sim->chip[0].fault = BQ2589X_FAULT_CHRG_THERMAL << BQ2589X_FAULT_CHRG_SHIFT;
+	sim_irq(sim);
+	KUNIT_EXPECT_TRUE(test, bq->status & BQ2589X_STATUS_FAULT);
+	KUNIT_EXPECT_FALSE(test, st->sm->events & BQ2589X_EV_PLUG_IN);
+	sim_irq(sim);
+	KUNIT_EXPECT_FALSE(test, bq->status & BQ2589X_STATUS_FAULT);
+
+	sim->chip[0].regs[BQ2589X_REG_03] &= ~BQ2589X_CHG_CONFIG_MASK;
+	sim_irq(sim);
+	KUNIT_EXPECT_EQ(test, (int)bq->chrg_stat, BQ2589X_CHRG_STAT_IDLE);
+
+	sim_unplug(sim);
+	KUNIT_EXPECT_FALSE(test, bq->status & BQ2589X_STATUS_PLUGIN);
+	KUNIT_EXPECT_FALSE(test, bq->status & BQ2589X_STATUS_PG);
+	KUNIT_EXPECT_TRUE(test, st->sm->events & BQ2589X_EV_PLUG_OUT);
+	sim_run(sim);
+	KUNIT_EXPECT_EQ(test, st->sm->state, BQ2589X_SM_IDLE);
+}
+
+/* a watchdog expiry reverts the chip to defaults, the fault brings the configuration back */
+static void bq2589x_test_irq_wdt_fault_restores(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+	u8 *regs = sim->chip[0].regs;
+
+	sim_plug(sim, &sim_sdp);
+	sim_run(sim);
+
+	sim_chip_por(&sim->chip[0], BQ25890);
+	sim->chip[0].fault = BQ2589X_FAULT_WDT_MASK;
+	sim_irq(sim);
+
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(regs[BQ2589X_REG_04], ICHG), 2048);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(regs[BQ2589X_REG_06], VREG), 4208);
+	KUNIT_EXPECT_EQ(test, sim_wdt(regs), BQ2589X_WDT_160S);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(regs[BQ2589X_REG_01], VINDPMOS), 600);
+	KUNIT_EXPECT_TRUE(test, regs[BQ2589X_REG_0D] & BQ2589X_FORCE_VINDPM_MASK);
+}
+
+static void bq2589x_test_watchdog_follows_session(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+	u8 *regs = sim->chip[0].regs;
+
+	KUNIT_EXPECT_EQ(test, sim_wdt(regs), BQ2589X_WDT_DISABLE);
+	sim_plug(sim, &sim_sdp);
+	sim_run(sim);
+	KUNIT_EXPECT_EQ(test, sim_wdt(regs), BQ2589X_WDT_160S);
+	sim_unplug(sim);
+	sim_run(sim);
+	KUNIT_EXPECT_EQ(test, sim_wdt(regs), BQ2589X_WDT_DISABLE);
+}
+
+static void bq2589x_test_pe_tune_up(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+	u8 *regs = sim->chip[0].regs;
+
+	sim_plug(sim, &sim_pe);
+	sim_run(sim);
+
+	KUNIT_ASSERT_EQ(test, st->sm->state, BQ2589X_SM_CHARGING);
+	KUNIT_EXPECT_TRUE(test, st->pe->tune_up_volt && st->pe->tune_done);
+	KUNIT_EXPECT_FALSE(test, st->pe->tune_fail);
+	KUNIT_EXPECT_EQ(test, st->pe->tune_count, 4);
+	KUNIT_EXPECT_EQ(test, sim->vbus_mv, 9000);
+	/* both chips placed below the raised VBUS */
+	KUNIT_EXPECT_TRUE(test, regs[BQ2589X_REG_0D] & BQ2589X_FORCE_VINDPM_MASK);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(regs[BQ2589X_REG_0D], VINDPM), 7800);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(sim_reg(sim, 1, BQ2589X_REG_0D), VINDPM), 7800);
+	KUNIT_EXPECT_EQ(test, st->sm->ico_ma, 2000);
+	KUNIT_EXPECT_EQ(test, st->bringup->hist[BQ2589X_BRINGUP_CLASS_PE].count, 1);
+}
+
+static void bq2589x_test_pe_fails_on_plain_dcp(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+
+	sim_plug(sim, &sim_dcp);
+	sim_run(sim);
+
+	KUNIT_ASSERT_EQ(test, st->sm->state, BQ2589X_SM_CHARGING);
+	KUNIT_EXPECT_TRUE(test, st->pe->tune_fail);
+	KUNIT_EXPECT_EQ(test, st->pe->tune_count, 11);
+	KUNIT_EXPECT_EQ(test, sim->vbus_mv, 5000);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(sim_reg(sim, 0, BQ2589X_REG_0D), VINDPM), 4400);
+	KUNIT_EXPECT_EQ(test, st->sm->ico_ma, 2000);
+	/* no PE+, no second charger on a 5v DCP */
+	KUNIT_EXPECT_FALSE(test, sim->bq[1]->enabled);
+	KUNIT_EXPECT_TRUE(test, sim_reg(sim, 1, BQ2589X_REG_00) & BQ2589X_ENHIZ_MASK);
+	KUNIT_EXPECT_EQ(test, st->bringup->hist[BQ2589X_VBUS_USB_DCP].count, 1);
+}
+
+static void bq2589x_test_chg2_engaged_after_pe(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+	u8 *regs = sim->chip[1].regs;
+
+	KUNIT_EXPECT_TRUE(test, regs[BQ2589X_REG_00] & BQ2589X_ENHIZ_MASK);
+	sim_plug(sim, &sim_pe);
+	sim_run(sim);
+
+	KUNIT_EXPECT_TRUE(test, sim->bq[1]->enabled);
+	KUNIT_EXPECT_FALSE(test, regs[BQ2589X_REG_00] & BQ2589X_ENHIZ_MASK);
+	/* its efficiency share of what ICO found */
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(regs[BQ2589X_REG_00], IINLIM), 1000);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(regs[BQ2589X_REG_04], ICHG), 2048);
+	KUNIT_EXPECT_GE(test, st->bringup->hist[BQ2589X_BRINGUP_CLASS_PE].mark_ms[0][BQ2589X_MARK_CHG2_ENABLE], 0);
+}
+
+static void bq2589x_test_chg2_engaged_on_hvdcp(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+
+	sim_plug(sim, &sim_hvdcp);
+	sim_run(sim);
+
+	KUNIT_ASSERT_EQ(test, st->sm->state, BQ2589X_SM_CHARGING);
+	KUNIT_EXPECT_EQ(test, st->pe->tune_count, 0);
+	KUNIT_EXPECT_TRUE(test, sim->bq[1]->enabled);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(sim_reg(sim, 1, BQ2589X_REG_00), IINLIM), 750);
+}
+
+static void bq2589x_test_chg2_parked_on_sdp(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+
+	sim_plug(sim, &sim_sdp);
+	sim_run(sim);
+
+	KUNIT_ASSERT_EQ(test, st->sm->state, BQ2589X_SM_CHARGING);
+	KUNIT_EXPECT_EQ(test, st->sm->ico_ma, 500);
+	KUNIT_EXPECT_FALSE(test, sim->bq[1]->enabled);
+	KUNIT_EXPECT_TRUE(test, sim_reg(sim, 1, BQ2589X_REG_00) & BQ2589X_ENHIZ_MASK);
+}
+
+/* inside the re-engage hysteresis band charger 2 stays out */
+static void bq2589x_test_chg2_stays_parked_near_full(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+
+	sim->bq[0]->batt_capacity = 92;
+	sim_plug(sim, &sim_pe);
+	sim_run(sim);
+
+	KUNIT_ASSERT_EQ(test, st->sm->state, BQ2589X_SM_CHARGING);
+	KUNIT_EXPECT_TRUE(test, st->pe->tune_done);
+	KUNIT_EXPECT_FALSE(test, sim->bq[1]->enabled);
+	KUNIT_EXPECT_TRUE(test, sim_reg(sim, 1, BQ2589X_REG_00) & BQ2589X_ENHIZ_MASK);
+}
+
+/* near full charger 2 steps down a monitor cycle at a time, then VBUS goes back to 5v */
+static void bq2589x_test_chg2_taper(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+	u8 *regs = sim->chip[1].regs;
+	int ichg;
+	int i;
+
+	sim_plug(sim, &sim_pe);
+	sim_run(sim);
+	KUNIT_ASSERT_TRUE(test, sim->bq[1]->enabled);
+
+	sim->bq[0]->batt_capacity = 96;
+	for (ichg = 2048 - 256, i = 0; ichg >= 512; ichg -= 256, i++) {
+		sim_monitor(sim);
+		KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(regs[BQ2589X_REG_04], ICHG), ichg);
+		KUNIT_EXPECT_FALSE(test, regs[BQ2589X_REG_00] & BQ2589X_ENHIZ_MASK);
+	}
+	KUNIT_EXPECT_EQ(test, i, 6);
+
+	sim_monitor(sim);
+	KUNIT_EXPECT_FALSE(test, sim->bq[1]->enabled);
+	KUNIT_EXPECT_TRUE(test, regs[BQ2589X_REG_00] & BQ2589X_ENHIZ_MASK);
+
+	/* PE_TUNE_DOWN followed it out */
+	KUNIT_EXPECT_EQ(test, st->sm->state, BQ2589X_SM_CHARGING);
+	KUNIT_EXPECT_TRUE(test, st->pe->tune_down_volt && st->pe->tune_done);
+	KUNIT_EXPECT_EQ(test, sim->vbus_mv, 5000);
+}
+
+/* a monitor pass left over from the session, e.g. re-armed by the battery notifier */
+static void bq2589x_test_monitor_stops_after_unplug(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+	struct bq2589x *bq = sim->bq[0];
+	u32 xfers;
+
+	sim_plug(sim, &sim_sdp);
+	sim_run(sim);
+	sim_unplug(sim);
+	sim_run(sim);
+	KUNIT_ASSERT_EQ(test, st->sm->state, BQ2589X_SM_IDLE);
+
+	xfers = sim_xfers(sim);
+	sim_advance(sim, BQ2589X_MONITOR_MS);
+	bq2589x_monitor_workfunc(&bq->monitor_work.work);
+	KUNIT_EXPECT_EQ(test, sim_xfers(sim), xfers);
+	KUNIT_EXPECT_FALSE(test, delayed_work_pending(&bq->monitor_work));
+}
+
+/* charger 2 must not be left running into the next session */
+static void bq2589x_test_unplug_parks_charger2(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+	u8 *regs = sim->chip[1].regs;
+
+	sim_plug(sim, &sim_pe);
+	sim_run(sim);
+	KUNIT_ASSERT_TRUE(test, sim->bq[1]->enabled);
+
+	sim_unplug(sim);
+	sim_run(sim);
+	KUNIT_ASSERT_EQ(test, st->sm->state, BQ2589X_SM_IDLE);
+	KUNIT_EXPECT_FALSE(test, sim->bq[1]->enabled);
+	KUNIT_EXPECT_TRUE(test, regs[BQ2589X_REG_00] & BQ2589X_ENHIZ_MASK);
+
+	/* an SDP doesn't get it, not even until detection has run */
+	sim_plug(sim, &sim_sdp);
+	KUNIT_EXPECT_TRUE(test, regs[BQ2589X_REG_00] & BQ2589X_ENHIZ_MASK);
+	sim_run(sim);
+	KUNIT_EXPECT_FALSE(test, sim->bq[1]->enabled);
+	KUNIT_EXPECT_TRUE(test, regs[BQ2589X_REG_00] & BQ2589X_ENHIZ_MASK);
+}
+
+/* the adapter goes away with a PE+ pulse train out */
+static void bq2589x_test_unplug_mid_tune(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+
+	sim_plug(sim, &sim_pe);
+	sim_run_until(sim, BQ2589X_SM_PE_PUMP_WAIT, 600 * MSEC_PER_SEC);
+	KUNIT_ASSERT_EQ(test, st->sm->state, BQ2589X_SM_PE_PUMP_WAIT);
+	KUNIT_ASSERT_NE(test, sim->chip[0].pump_dir, 0);
+
+	sim_unplug(sim);
+	sim_run(sim);
+	KUNIT_ASSERT_EQ(test, st->sm->state, BQ2589X_SM_IDLE);
+	KUNIT_EXPECT_FALSE(test, st->pe->tune_up_volt || st->pe->tune_down_volt || st->pe->tune_done);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(sim_reg(sim, 0, BQ2589X_REG_0D), VINDPM), 4400);
+	KUNIT_EXPECT_EQ(test, BQ2589X_DECODE(sim_reg(sim, 1, BQ2589X_REG_0D), VINDPM), 4400);
+	KUNIT_EXPECT_TRUE(test, sim_reg(sim, 1, BQ2589X_REG_00) & BQ2589X_ENHIZ_MASK);
+	KUNIT_EXPECT_EQ(test, sim_wdt(sim->chip[0].regs), BQ2589X_WDT_DISABLE);
+
+	/* nothing carried over into the next session */
+	sim_plug(sim, &sim_pe);
+	sim_run(sim);
+	KUNIT_ASSERT_EQ(test, st->sm->state, BQ2589X_SM_CHARGING);
+	KUNIT_EXPECT_TRUE(test, st->pe->tune_done);
+	KUNIT_EXPECT_EQ(test, st->pe->tune_count, 4);
+	KUNIT_EXPECT_EQ(test, sim->vbus_mv, 9000);
+	KUNIT_EXPECT_TRUE(test, sim->bq[1]->enabled);
+}
+
+/* status interrupts while tuning and while ICO runs don't restart the bring up */
+static void bq2589x_test_irq_during_pe_ico(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+
+	sim_plug(sim, &sim_pe);
+	sim_run_until(sim, BQ2589X_SM_PE_PUMP_WAIT, 600 * MSEC_PER_SEC);
+	KUNIT_ASSERT_EQ(test, st->sm->state, BQ2589X_SM_PE_PUMP_WAIT);
+	sim_irq(sim);
+
+	sim_run_until(sim, BQ2589X_SM_ICO_WAIT, 600 * MSEC_PER_SEC);
+	KUNIT_ASSERT_EQ(test, st->sm->state, BQ2589X_SM_ICO_WAIT);
+	sim_irq(sim);
+	sim_run(sim);
+
+	KUNIT_ASSERT_EQ(test, st->sm->state, BQ2589X_SM_CHARGING);
+	KUNIT_EXPECT_TRUE(test, st->pe->tune_done);
+	KUNIT_EXPECT_EQ(test, st->pe->tune_count, 4);
+	KUNIT_EXPECT_EQ(test, sim->vbus_mv, 9000);
+	KUNIT_EXPECT_EQ(test, st->sm->ico_ma, 2000);
+	KUNIT_EXPECT_EQ(test, st->bringup->hist[BQ2589X_BRINGUP_CLASS_PE].count, 1);
+	KUNIT_EXPECT_TRUE(test, sim->bq[1]->enabled);
+}
+
+/* a noisy bus: the retries absorb it, the session comes out the same */
+static void bq2589x_test_i2c_errors_retried(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+
+	sim->fail_pm = 100;
+	sim_plug(sim, &sim_pe);
+	sim_run(sim);
+	sim->fail_pm = 0;
+
+	KUNIT_EXPECT_GT(test, sim->bq[0]->i2c_retried + sim->bq[1]->i2c_retried, 0);
+	KUNIT_EXPECT_EQ(test, sim->bq[0]->i2c_failures + sim->bq[1]->i2c_failures, 0);
+	KUNIT_ASSERT_EQ(test, st->sm->state, BQ2589X_SM_CHARGING);
+	KUNIT_EXPECT_TRUE(test, st->pe->tune_done);
+	KUNIT_EXPECT_EQ(test, sim->vbus_mv, 9000);
+	KUNIT_EXPECT_EQ(test, st->sm->ico_ma, 2000);
+	KUNIT_EXPECT_TRUE(test, sim->bq[1]->enabled);
+}
+
+/* the bus drops out mid tune: bounded work while it is gone, a clean recovery after */
+static void bq2589x_test_i2c_errors_bus_lost(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+	int runs;
+
+	sim_plug(sim, &sim_pe);
+	sim_run_until(sim, BQ2589X_SM_PE_PUMP_WAIT, 600 * MSEC_PER_SEC);
+	KUNIT_ASSERT_EQ(test, st->sm->state, BQ2589X_SM_PE_PUMP_WAIT);
+
+	sim->fail_next = INT_MAX;
+	for (runs = 0; runs < 20; runs++) {
+		sim_run_until(sim, -1, 5 * MSEC_PER_SEC);
+		KUNIT_EXPECT_LE(test, st->sm->peak_xfers, SIM_XFER_BUDGET);
+	}
+	/* failed reads are no unplug */
+	sim_irq(sim);
+	sim_monitor(sim);
+	KUNIT_EXPECT_GT(test, sim->bq[0]->i2c_failures + sim->bq[1]->i2c_failures, 0);
+	KUNIT_EXPECT_EQ(test, st->sm->state, BQ2589X_SM_PE_PUMP_WAIT);
+	KUNIT_EXPECT_EQ(test, sim->bq[0]->vbus_type, BQ2589X_VBUS_USB_DCP);
+
+	sim->fail_next = 0;
+	sim_run(sim);
+	KUNIT_ASSERT_EQ(test, st->sm->state, BQ2589X_SM_CHARGING);
+	KUNIT_EXPECT_TRUE(test, st->pe->tune_done);
+	KUNIT_EXPECT_EQ(test, sim->vbus_mv, 9000);
+	KUNIT_EXPECT_TRUE(test, sim->bq[1]->enabled);
+	KUNIT_EXPECT_EQ(test, st->bringup->hist[BQ2589X_BRINGUP_CLASS_PE].count, 1);
+}
+
+/*
+ * Status, fault and ADC registers read back random while interrupts, the
+ * state machine and the monitor run in random order. Whatever they say,
+ * every run stays bounded and charger 2 is only out of HiZ when the
+ * driver engaged it; once they are sane again an unplug ends it cleanly.
+ */
+static void bq2589x_test_register_fuzz(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+	u8 *regs = sim->chip[1].regs;
+	int i;
+
+	sim_plug(sim, &sim_pe);
+	sim->fuzz = true;
+	for (i = 0; i < 500; i++) {
+		switch (prandom_u32_state(&sim->rnd) % 3) {
+		case 0:
+			sim_irq(sim);
+			break;
+		case 1:
+			sim_run_until(sim, -1, 5 * MSEC_PER_SEC);
+			break;
+		default:
+			sim_monitor(sim);
+			break;
+		}
+		KUNIT_ASSERT_LT(test, st->sm->state, BQ2589X_SM_NUM);
+		KUNIT_ASSERT_LE(test, st->sm->peak_xfers, SIM_XFER_BUDGET);
+		if (!(regs[BQ2589X_REG_00] & BQ2589X_ENHIZ_MASK))
+			KUNIT_ASSERT_TRUE(test, sim->bq[1]->enabled);
+	}
+	sim->fuzz = false;
+
+	sim_unplug(sim);
+	sim_run(sim);
+	KUNIT_EXPECT_EQ(test, st->sm->state, BQ2589X_SM_IDLE);
+	KUNIT_EXPECT_FALSE(test, sim->bq[1]->enabled);
+	KUNIT_EXPECT_TRUE(test, regs[BQ2589X_REG_00] & BQ2589X_ENHIZ_MASK);
+	KUNIT_EXPECT_EQ(test, sim_wdt(sim->chip[0].regs), BQ2589X_WDT_DISABLE);
+}
+
+static int sim_cmp_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* median end to end latency of a class, the same pick bringup_stats makes */
+static int sim_e2e_p50(int cls)
+{
+	const struct bq2589x_bringup_hist *hist = &st->bringup->hist[cls];
+	int sorted[BQ2589X_BRINGUP_HISTORY];
+
+	memcpy(sorted, hist->e2e_ms, hist->count * sizeof(*sorted));
+	sort(sorted, hist->count, sizeof(*sorted), sim_cmp_int, NULL);
+	return sorted[(hist->count - 1) / 2];
+}
+
+/*
+ * Plug to full rate for each adapter class, a handful of insertions with
+ * jittered IRQ latency and pulse train timing. The bringup_stats report
+ * goes to the test log, one line per stage, so two driver versions can be
+ * diffed; the checks only pin down what must hold between classes.
+ */
+static void bq2589x_test_bringup_latency(struct kunit *test)
+{
+	static const struct {
+		const struct sim_adapter *adapter;
+		int cls;
+	} classes[] = {
+		{ &sim_dcp, BQ2589X_VBUS_USB_DCP },
+		{ &sim_pe, BQ2589X_BRINGUP_CLASS_PE },
+		{ &sim_hvdcp, BQ2589X_VBUS_MAXC },
+		{ &sim_sdp, BQ2589X_VBUS_USB_SDP },
+		{ &sim_nonstand, BQ2589X_VBUS_NONSTAND },
+	};
+	struct sim *sim = test->priv;
+	struct bq2589x_bringup_hist *hist;
+	struct sim_adapter a;
+	char *buf, *line, *next;
+	int pe_p50;
+	int i, run;
+
+	for (i = 0; i < ARRAY_SIZE(classes); i++) {
+		/* a PE+ charger and a plain DCP look alike to the adapter cache */
+		*st->acache = saved_acache;
+
+		for (run = 0; run < 8; run++) {
+			a = *classes[i].adapter;
+			if (a.pump_ms)
+				a.pump_ms += prandom_u32_state(&sim->rnd) % 500;
+
+			sim_plug(sim, &a);
+			sim_advance(sim, prandom_u32_state(&sim->rnd) % 200);
+			sim_run(sim);
+			KUNIT_ASSERT_EQ(test, st->sm->state, BQ2589X_SM_CHARGING);
+			sim_unplug(sim);
+			sim_run(sim);
+			sim_advance(sim, 5 * MSEC_PER_SEC);
+		}
+
+		hist = &st->bringup->hist[classes[i].cls];
+		KUNIT_ASSERT_EQ(test, hist->count, 8);
+		KUNIT_EXPECT_GT(test, hist->xfers[0], 0);
+	}
+
+	/* PE+ pays for its pulses, HVDCP gets the same dual rate without them */
+	pe_p50 = sim_e2e_p50(BQ2589X_BRINGUP_CLASS_PE);
+	KUNIT_EXPECT_LT(test, sim_e2e_p50(BQ2589X_VBUS_USB_SDP), pe_p50);
+	KUNIT_EXPECT_LT(test, sim_e2e_p50(BQ2589X_VBUS_MAXC), pe_p50);
+
+	/* a DCP that doesn't answer pays for every pulse once, then it is remembered */
+	hist = &st->bringup->hist[BQ2589X_VBUS_USB_DCP];
+	KUNIT_EXPECT_GT(test, hist->e2e_ms[0], pe_p50);
+	KUNIT_EXPECT_LT(test, sim_e2e_p50(BQ2589X_VBUS_USB_DCP), pe_p50);
+
+	buf = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buf);
+	bq2589x_show_bringup_stats(sim->bq[0]->dev, NULL, buf);
+	for (line = buf; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		kunit_info(test, "%s", line);
+	}
+}
+
+static struct bq2589x_trace *sim_trace(struct kunit *test, struct bq2589x *bq)
+{
+	struct bq2589x_trace *t;
+
+	t = kunit_kzalloc(test, sizeof(*t) + BQ2589X_TRACE_MAX_DEPTH * sizeof(t->rec[0]),
+			GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, t);
+	spin_lock_init(&t->lock);
+	t->depth = BQ2589X_TRACE_MAX_DEPTH;
+	bq->trace = t;
+	return t;
+}
+
+static void sim_replay_script(struct sim *sim)
+{
+	int i;
+
+	sim_plug(sim, &sim_pe);
+	sim_run(sim);
+	for (i = 0; i < 3; i++)
+		sim_monitor(sim);
+	sim_unplug(sim);
+	sim_run(sim);
+}
+
+/*
+ * A session recorded by the i2c recorder, fed back to a freshly booted
+ * driver through the same hook the simulation uses: from the recorded
+ * reads alone it must come to the same decisions, every write and its
+ * value included.
+ */
+static void bq2589x_test_trace_replay(struct kunit *test)
+{
+	struct sim *sim = test->priv;
+	struct bq2589x_trace *t[2];
+	int tune_count, ico_ma;
+	int i;
+
+	for (i = 0; i < 2; i++)
+		t[i] = sim_trace(test, sim->bq[i]);
+	sim_replay_script(sim);
+	KUNIT_ASSERT_EQ(test, st->bringup->hist[BQ2589X_BRINGUP_CLASS_PE].count, 1);
+	tune_count = st->pe->tune_count;
+	ico_ma = st->sm->ico_ma;
+	for (i = 0; i < 2; i++) {
+		KUNIT_ASSERT_LE(test, t[i]->head, t[i]->depth);
+		sim->bq[i]->trace = NULL;
+	}
+
+	sim = sim_new(test);
+	for (i = 0; i < 2; i++)
+		sim->replay[i] = t[i];
+	sim_replay_script(sim);
+
+	KUNIT_EXPECT_EQ(test, sim->diverged, 0);
+	for (i = 0; i < 2; i++)
+		KUNIT_EXPECT_EQ(test, sim->replay_pos[i], t[i]->head);
+	KUNIT_EXPECT_EQ(test, st->bringup->hist[BQ2589X_BRINGUP_CLASS_PE].count, 1);
+	KUNIT_EXPECT_EQ(test, st->pe->tune_count, tune_count);
+	KUNIT_EXPECT_EQ(test, st->sm->ico_ma, ico_ma);
+	kunit_info(test, "replayed %u + %u transactions", t[0]->head, t[1]->head);
+}
+
+static struct kunit_case bq2589x_test_cases[] = {
+	KUNIT_CASE(bq2589x_test_encode_clamps),
+	KUNIT_CASE(bq2589x_test_encode_decode),
+	KUNIT_CASE(bq2589x_test_setters_clamp),
+	KUNIT_CASE(bq2589x_test_setters_keep_other_bits),
+	KUNIT_CASE(bq2589x_test_staging),
+	KUNIT_CASE(bq2589x_test_xfer_counts),
+	KUNIT_CASE(bq2589x_test_irq_status_decode),
+	KUNIT_CASE(bq2589x_test_irq_wdt_fault_restores),
+	KUNIT_CASE(bq2589x_test_watchdog_follows_session),
+	KUNIT_CASE(bq2589x_test_pe_tune_up),
+	KUNIT_CASE(bq2589x_test_pe_fails_on_plain_dcp),
+	KUNIT_CASE(bq2589x_test_chg2_engaged_after_pe),
+	KUNIT_CASE(bq2589x_test_chg2_engaged_on_hvdcp),
+	KUNIT_CASE(bq2589x_test_chg2_parked_on_sdp),
+	KUNIT_CASE(bq2589x_test_chg2_stays_parked_near_full),
+	KUNIT_CASE(bq2589x_test_chg2_taper),
+	KUNIT_CASE(bq2589x_test_monitor_stops_after_unplug),
+	KUNIT_CASE(bq2589x_test_unplug_parks_charger2),
+	KUNIT_CASE(bq2589x_test_unplug_mid_tune),
+	KUNIT_CASE(bq2589x_test_irq_during_pe_ico),
+	KUNIT_CASE(bq2589x_test_i2c_errors_retried),
+	KUNIT_CASE(bq2589x_test_i2c_errors_bus_lost),
+	KUNIT_CASE(bq2589x_test_register_fuzz),
+	KUNIT_CASE(bq2589x_test_bringup_latency),
+	KUNIT_CASE(bq2589x_test_trace_replay),
+	{}
+};
+
+static struct kunit_suite bq2589x_test_suite = {
+	.name = "bq2589x_dual",
+	.init = bq2589x_test_init,
+	.exit = bq2589x_test_exit,
+	.test_cases = bq2589x_test_cases,
+};
+
+kunit_test_suite(bq2589x_test_suite);
@@ -17,6 +17,7 @@
 #define BQ2589X_IINLIM_SHIFT		0
 #define BQ2589X_IINLIM_BASE         100
 #define BQ2589X_IINLIM_LSB          50
+#define BQ2589X_IINLIM_MAX          3250
 
 /* Register 01h */
 #define BQ2589X_REG_01		    	0x01
@@ -104,6 +105,7 @@
 #define BQ2589X_ICHG_SHIFT          0
 #define BQ2589X_ICHG_BASE           0
 #define BQ2589X_ICHG_LSB            64
+#define BQ2589X_ICHG_MAX            5056
 
 /* Register 0x05*/
 #define BQ2589X_REG_05              0x05
@@ -130,6 +132,7 @@
 #define BQ2589X_VRECHG_200MV        1
 #define BQ2589X_VREG_BASE           3840
 #define BQ2589X_VREG_LSB            16
+#define BQ2589X_VREG_MAX            4608
 
 /* Register 0x07*/
 #define BQ2589X_REG_07              0x07
@@ -310,8 +313,8 @@
 #define BQ2589X_REG_10              0x10
 #define BQ2589X_TSPCT_MASK          0x7F
 #define BQ2589X_TSPCT_SHIFT         0
-#define BQ2589X_TSPCT_BASE          21
-#define BQ2589X_TSPCT_LSB           465//should be 0.465,kernel does not support float
+#define BQ2589X_TSPCT_BASE          21000	/* TS/REGN in milli-percent */
+#define BQ2589X_TSPCT_LSB           465
 
 /* Register 0x11*/
 #define BQ2589X_REG_11              0x11